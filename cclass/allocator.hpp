@@ -0,0 +1,226 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief C++ allocator declaration
+ *
+ * A standard allocator that places container nodes and buffers on the
+ * cclass heap.  Each pool owns a class descriptor, so container memory
+ * shows up per class in cclass_walk_heap() and the heap statistics.
+ * Pools are CCLASS_HUGEPAGE classes by default: blocks of up to 64 KiB
+ * come from the size class free lists of the huge page arena.
+ *
+ * Usage:
+ * @code
+ * static cclass::pool sessions("sessions");
+ * typedef std::pair<const int, session> entry;
+ * cclass::allocator<entry> allocator(sessions);
+ * std::map<int, session, std::less<int>, cclass::allocator<entry> >
+ *     map(allocator);
+ * @endcode
+ */
+#ifndef ITL_CCLASS_ALLOCATOR_HPP
+#define ITL_CCLASS_ALLOCATOR_HPP
+
+#include <cclass/malloc.h>
+
+#include <cstddef> /* size_t */
+#include <cstdlib> /* free */
+#include <cstring> /* memset */
+#include <new> /* bad_alloc */
+#include <type_traits> /* true_type */
+
+namespace cclass {
+
+/**
+ * @brief Class descriptor for the memory of containers
+ *
+ * A pool must outlive the memory allocated from it.
+ */
+class pool {
+public:
+	/**
+	 * @brief Create pool
+	 *
+	 * @param[in] name  class name tag, kept by reference
+	 * @param[in] flags  CCLASS_* allocation flags
+	 */
+	explicit pool(const char *name,
+		      unsigned flags = CCLASS_HUGEPAGE)
+	{
+		std::memset(&desc_, 0, sizeof(desc_));
+		desc_.name = const_cast<char *>(name);
+		desc_.flags = flags;
+	}
+
+	/** Release the live object list, once no objects are left */
+	~pool()
+	{
+		if (!desc_.count) {
+			std::free(desc_.objects);
+		}
+	}
+
+	/** @return class descriptor of the pool */
+	classdesc *desc()
+	{
+		return &desc_;
+	}
+
+private:
+	pool(const pool &);
+	pool &operator=(const pool &);
+
+	classdesc desc_; /**< class descriptor */
+};
+
+/**
+ * @brief Pool of memory not tagged with a particular container
+ *
+ * @return pool named "std"
+ */
+inline pool &
+default_pool()
+{
+	static pool std_pool("std");
+	return std_pool;
+}
+
+/**
+ * @brief Standard allocator on the cclass heap
+ *
+ * All instances compare equal, since any block on the heap can be freed
+ * without knowing its class.  Allocation failures throw std::bad_alloc.
+ */
+template <typename T>
+class allocator {
+public:
+	typedef T value_type; /**< allocated type */
+	typedef T *pointer; /**< pointer to allocated type */
+	typedef const T *const_pointer; /**< pointer to const type */
+	typedef T &reference; /**< reference to allocated type */
+	typedef const T &const_reference; /**< reference to const type */
+	typedef std::size_t size_type; /**< size of allocation */
+	typedef std::ptrdiff_t difference_type; /**< pointer difference */
+	/** containers move the allocator with their memory */
+	typedef std::true_type propagate_on_container_move_assignment;
+	/** containers swap the allocator with their memory */
+	typedef std::true_type propagate_on_container_swap;
+	/** all instances compare equal */
+	typedef std::true_type is_always_equal;
+
+	/** Same allocator for another type */
+	template <typename U>
+	struct rebind {
+		typedef allocator<U> other; /**< rebound allocator */
+	};
+
+	/** Allocate from the default pool */
+	allocator() noexcept : desc_(default_pool().desc())
+	{
+	}
+
+	/**
+	 * @brief Allocate from a pool
+	 *
+	 * @param[in] p  pool to tag allocations with
+	 */
+	allocator(pool &p) noexcept : desc_(p.desc())
+	{
+	}
+
+	/**
+	 * @brief Allocate from the pool of another allocator
+	 *
+	 * @param[in] other  allocator of another type
+	 */
+	template <typename U>
+	allocator(const allocator<U> &other) noexcept : desc_(other.desc())
+	{
+	}
+
+	/**
+	 * @brief Allocate memory for n objects
+	 *
+	 * @param[in] n  number of objects
+	 *
+	 * @return uninitialised memory
+	 */
+	T *allocate(std::size_t n)
+	{
+		void *mem = 0;
+
+		if (n <= max_size()) {
+			mem = cclass_malloc(n * sizeof(T), desc_, __FILE__,
+					    __LINE__);
+		}
+		if (!mem) {
+			throw std::bad_alloc();
+		}
+
+		return static_cast<T *>(mem);
+	}
+
+	/**
+	 * @brief Free memory for objects
+	 *
+	 * @param[in] p  memory returned by allocate()
+	 */
+	void deallocate(T *p,
+			std::size_t)
+	{
+		cclass_free(p);
+	}
+
+	/** @return largest number of objects allocate() may succeed for */
+	std::size_t max_size() const noexcept
+	{
+		return (std::size_t) -1 / 2 / sizeof(T);
+	}
+
+	/** @return class descriptor allocations are tagged with */
+	classdesc *desc() const noexcept
+	{
+		return desc_;
+	}
+
+private:
+	classdesc *desc_; /**< class descriptor of allocations */
+};
+
+/** @return true: memory of either allocator may be freed by the other */
+template <typename T, typename U>
+inline bool
+operator==(const allocator<T> &,
+	   const allocator<U> &) noexcept
+{
+	return true;
+}
+
+/** @return false: memory of either allocator may be freed by the other */
+template <typename T, typename U>
+inline bool
+operator!=(const allocator<T> &,
+	   const allocator<U> &) noexcept
+{
+	return false;
+}
+
+} /* namespace cclass */
+
+#endif /* ITL_CCLASS_ALLOCATOR_HPP */
@@ -29,6 +29,7 @@
 
 #include "assert.h"
 #include "malloc.h"
+#include "probes.h"
 
 #ifndef DOXYGEN_SKIP
 USE_XASSERT
@@ -36,6 +37,7 @@ USE_XASSERT
 
 bool XASSERT_INTERACTIVE = true;
 bool XASSERT_FAILURE = false;
+FILE *XASSERT_STREAM = 0;
 
 int
 cclass_assert_test(void (*test_func)())
@@ -70,14 +72,18 @@ void
 cclass_assert_report(const char *file_name,
 		     int line)
 {
-	printf(" ** cclass_assert: %s-%d ", file_name, line);
+	FILE *out = (XASSERT_STREAM ? XASSERT_STREAM : stdout);
+
+	CCLASS_PROBE2(assert, file_name, line);
+	fprintf(out, " ** cclass_assert: %s-%d ", file_name, line);
 	XASSERT_FAILURE = true;
 	if (XASSERT_INTERACTIVE) {
-		printf("(Press ENTER) ");
+		fprintf(out, "(Press ENTER) ");
+		fflush(out);
 		while ('\n' != getchar()) {
 			usleep(250000);
 		}
 	} else {
-		printf("\n");
+		fprintf(out, "\n");
 	}
 }
@@ -23,6 +23,7 @@
 #define ITL_CCLASS_ASSERT_H
 
 #include <stdbool.h> /* bool */
+#include <stdio.h> /* FILE */
 #include <sys/cdefs.h>
 
 __BEGIN_DECLS
@@ -71,6 +72,10 @@ extern bool XASSERT_FAILURE;
  * failure report
  */
 extern bool XASSERT_INTERACTIVE;
+/**
+ * @brief Stream for assertion failure reports, or 0 for stdout
+ */
+extern FILE *XASSERT_STREAM;
 
 /**
  * @brief Test framework function
@@ -34,6 +34,7 @@
 
 #include <cclass/assert.h>
 #include <cclass/malloc.h>
+#include <stddef.h> /* offsetof */
 
 __BEGIN_DECLS
 
@@ -76,13 +77,38 @@ __BEGIN_DECLS
  */
 #ifndef DOXYGEN_SKIP
 #define CLASS(object,handle) \
-  static classdesc _CD(object)={#object}; \
+  static classdesc _CD(object)={.name=#object}; \
   struct tag_##handle
 #else
 #define CLASS(object, handle) \
   struct handle
 #endif
 
+/**
+ * @brief The class macro, with class descriptor settings
+ *
+ * As CLASS(), but also initialises the class descriptor fields given
+ * as designated initialisers.
+ *
+ * @param[in] object  the object handle, to be used in the VERIFY* type
+ * macros
+ * @param[in] handle  the object handle type, used to declare an object
+ * @param[in] ...  class descriptor field initialisers
+ *
+ * For example:
+ * @code
+ * CLASS_WITH(list, list_t, .flags = CCLASS_HUGEPAGE)
+ * @endcode
+ */
+#ifndef DOXYGEN_SKIP
+#define CLASS_WITH(object,handle,...) \
+  static classdesc _CD(object)={.name=#object,__VA_ARGS__}; \
+  struct tag_##handle
+#else
+#define CLASS_WITH(object, handle, ...) \
+  struct handle
+#endif
+
 /* object verification macros */
 /**
  * @def VERIFY(obj)
@@ -124,14 +150,41 @@ __BEGIN_DECLS
  */
 #define VERIFYZ(obj) if (!(obj)) {} else VERIFY(obj)
 
-/* WARNING: _VERIFY needs be tailored to your environment */
+/**
+ * @def VERIFY_HANDLE(obj,handle)
+ * @brief Verify a handle, and get its object
+ *
+ * Verify that the handle is live and of the object's type, as declared
+ * to the heap manager, and set obj to its object.  Only the handle table
+ * is read, not the memory of the object.
+ *
+ * @param[out] obj  object of the handle, or 0
+ * @param[in] handle  cclass_handle to verify
+ *
+ * For example:
+ * @code
+ * cclass_handle handle;
+ * NEWOBJ_HANDLE(obj, handle);
+ * // ...
+ * VERIFY_HANDLE(obj, handle) {
+ *     // only executed if verification holds
+ *     FREEOBJ(obj); // handle turns stale
+ * }
+ * @endcode
+ */
+#define VERIFY_HANDLE(obj,handle) \
+  cclass_assert((obj = cclass_handle_object(handle,&_CD(obj))))
+
+/* _S4, _S8 and _SR are the distances back from an object to its header */
 #ifndef DOXYGEN_SKIP
-#define _S4 (sizeof(classdesc*))
-#define _S8 (sizeof(classdesc*)+sizeof(void *))
+#define _S4 (sizeof(cclass_header)-offsetof(cclass_header,desc))
+#define _S8 (sizeof(cclass_header)-offsetof(cclass_header,mem))
+#define _SR (sizeof(cclass_header)-offsetof(cclass_header,refs))
 #define _VERIFY(obj) \
   ( cclass_test_pointer(obj) && \
     (((void *)obj) == *(void **)((char *)obj-_S8)) \
-    && ((&_CD(obj)) == *(classdesc **)((char *)obj-_S4)) )
+    && ((&_CD(obj)) == *(classdesc **)((char *)obj-_S4)) \
+    && *(unsigned *)((char *)obj-_SR) )
 #endif /* DOXYGEN_SKIP */
 
 __END_DECLS
@@ -0,0 +1,196 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief C++ typed object declaration
+ *
+ * The C++ counterpart of CLASS(), NEWOBJ(), VERIFY() and FREEOBJ().
+ * Each type gets its own class descriptor through a template, so no
+ * file-static descriptor or token pasting is needed, and the functions
+ * work in templates and inline functions alike.  Verification reads
+ * the object header through cclass_header, inline.
+ *
+ * Usage:
+ * @code
+ * namespace cclass {
+ * template <> struct traits<session> {
+ *     static const char *name() { return "session"; }
+ *     static const unsigned flags = CCLASS_HUGEPAGE;
+ * };
+ * }
+ *
+ * session *s = cclass::make<session>(fd);
+ * if (cclass::verify(s)) {
+ *     // ...
+ * }
+ * cclass::destroy(s);
+ * @endcode
+ */
+#ifndef ITL_CCLASS_HANDLE_HPP
+#define ITL_CCLASS_HANDLE_HPP
+
+#include <cclass/malloc.h>
+
+#include <cstddef> /* max_align_t */
+#include <cstdint> /* uintptr_t */
+#include <new> /* placement new, bad_alloc */
+#include <type_traits> /* is_trivially_destructible */
+#include <typeinfo> /* typeid */
+#include <utility> /* forward */
+
+namespace cclass {
+
+/**
+ * @brief Class descriptor settings of a type
+ *
+ * Specialise for a type to name its class or set CCLASS_* flags.
+ */
+template <typename T>
+struct traits {
+	/** @return class name tag, the mangled type name by default */
+	static const char *name()
+	{
+		return typeid(T).name();
+	}
+
+	static const unsigned flags = 0; /**< CCLASS_* allocation flags */
+};
+
+/**
+ * @brief Init hook that leaves construction to make()
+ */
+inline void
+construct_later(void *)
+{
+}
+
+/**
+ * @brief Initial class descriptor of a type
+ *
+ * The init hook keeps the heap from zeroing memory that make()
+ * constructs.
+ *
+ * @return class descriptor settings from traits<T>
+ */
+template <typename T>
+inline classdesc
+describe()
+{
+	classdesc desc = classdesc();
+
+	desc.name = const_cast<char *>(traits<T>::name());
+	desc.flags = traits<T>::flags;
+	desc.init = construct_later;
+
+	return desc;
+}
+
+/**
+ * @brief Class descriptor of a type
+ *
+ * One descriptor per type, shared by all translation units.
+ *
+ * @return class descriptor
+ */
+template <typename T>
+inline classdesc *
+descriptor()
+{
+	static classdesc desc = describe<T>();
+
+	return &desc;
+}
+
+/**
+ * @brief Verify an object
+ *
+ * Inline VERIFY(): the object is on the heap, of type T, and not
+ * released.
+ *
+ * @param[in] obj  object to verify
+ *
+ * @return true if obj is a live object of type T
+ */
+template <typename T>
+inline bool
+verify(const T *obj)
+{
+	const cclass_header *h = reinterpret_cast<const cclass_header *>(obj);
+
+	return (obj && !(reinterpret_cast<std::uintptr_t>(obj) &
+			 (sizeof(int) - 1)) &&
+		h[-1].mem == obj && h[-1].desc == descriptor<T>() &&
+		h[-1].refs);
+}
+
+/**
+ * @brief Allocate and construct an object
+ *
+ * The size is known at compile time, and the memory is not zeroed
+ * before the constructor runs.
+ *
+ * @param[in] args  constructor arguments
+ *
+ * @return new object; throws std::bad_alloc if out of memory
+ */
+template <typename T, typename... Args>
+inline T *
+make(Args &&... args)
+{
+	static_assert(alignof(T) <= alignof(std::max_align_t),
+		      "over-aligned types are not supported");
+	void *mem = cclass_malloc(sizeof(T), descriptor<T>(), __FILE__,
+				  __LINE__);
+
+	if (!mem) {
+		throw std::bad_alloc();
+	}
+	try {
+		return new (mem) T(std::forward<Args>(args)...);
+	} catch (...) {
+		cclass_free(mem);
+		throw;
+	}
+}
+
+/**
+ * @brief Destroy and free an object
+ *
+ * Inline FREEOBJ(): the object is verified, destructed and freed.
+ * Verification failures are reported through cclass_assert_report().
+ *
+ * @param[in,out] obj  object to destroy (or 0), set to 0
+ */
+template <typename T>
+inline void
+destroy(T *&obj)
+{
+	if (obj && !verify(obj)) {
+		cclass_assert_report(__FILE__, __LINE__);
+	} else if (obj) {
+		if (!std::is_trivially_destructible<T>::value) {
+			obj->~T();
+		}
+		cclass_free(obj);
+	}
+	obj = 0;
+}
+
+} /* namespace cclass */
+
+#endif /* ITL_CCLASS_HANDLE_HPP */
@@ -19,30 +19,52 @@
  * @file
  * @brief Memory allocation function definition
  */
+#define _GNU_SOURCE /* dl_iterate_phdr() */
 #include <errno.h>
+#include <execinfo.h> /* backtrace() */
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h> /* dl_iterate_phdr() */
+#include <malloc.h> /* malloc_usable_size() */
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> /* __rdtsc() */
+#endif
 
 #include "classdef.h"
 #include "malloc.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
 
 USE_XASSERT
 
 #ifndef DOXYGEN_SKIP
 #define ALIGNMENT (sizeof(int))
 #define DOALIGN(num) (((num)+ALIGNMENT-1)&~(ALIGNMENT-1))
+#define BLOCKSIZE(size) (sizeof(prefix)+(size)+sizeof(postfix))
+/* Largest object size that DOALIGN() and BLOCKSIZE() do not wrap */
+#define SIZE_LIMIT (SIZE_MAX - BLOCKSIZE(ALIGNMENT))
 cclass_compiler_assert(ISPOWER2(ALIGNMENT));
 #endif
 
 /* Prefix structure before every heap object */
 #ifndef DOXYGEN_SKIP
 typedef struct prefix_tag {
-	struct prefix_tag *prev;	/* previous object in heap   */
-	struct prefix_tag *next;	/* next object in heap       */
+	size_t index;			/* slot in block registry    */
 	struct postfix_tag *postfix;	/* ptr to postfix object     */
-	const char *file;		/* file name ptr or 0        */
-	long line;			/* line number or 0          */
+	struct origin_tag *origin;	/* slab, arena region or 0   */
+	unsigned class_index;		/* slot in class objects     */
+	unsigned refs;			/* references, 0 once freed  */
 	void *mem;			/* xnew() ptr of object      */
 	classdesc *class;		/* class descriptor ptr or 0 */
 } prefix;
@@ -58,164 +80,3624 @@ typedef struct postfix_tag {
 /* Verify alignment of prefix structure */
 cclass_compiler_assert(!(sizeof(prefix) % ALIGNMENT));
 
-/* Points to first object in linked list of heap objects */
+/* Verify that the prefix ends in the public header tail */
+cclass_compiler_assert(sizeof(prefix) - offsetof(prefix, class_index) ==
+		       sizeof(cclass_header));
+cclass_compiler_assert(offsetof(prefix, refs) - offsetof(prefix, class_index)
+		       == offsetof(cclass_header, refs));
+cclass_compiler_assert(offsetof(prefix, mem) - offsetof(prefix, class_index) ==
+		       offsetof(cclass_header, mem));
+cclass_compiler_assert(offsetof(prefix, class) - offsetof(prefix, class_index)
+		       == offsetof(cclass_header, desc));
+
+/*
+ * Header of memory holding several heap objects: a batch slab (one
+ * backend allocation) or an arena region.  Objects of a slab follow its
+ * header directly.
+ */
+#ifndef DOXYGEN_SKIP
+typedef struct origin_tag {
+	enum {
+		ORIGIN_SLAB = 1,	/* batch slab                */
+		ORIGIN_REGION		/* huge page arena region    */
+	} kind;
+	size_t live;			/* live objects in origin    */
+} origin;
+
+/* Alignment of max_align_t, which gnu99 does not have */
+#define SLAB_ALIGNMENT \
+  __alignof__(union { long long ll; long double ld; void *p; })
+#define SLAB_ALIGN(num) \
+  (((num)+SLAB_ALIGNMENT-1)&~(SLAB_ALIGNMENT-1))
+cclass_compiler_assert(!(sizeof(origin) % SLAB_ALIGNMENT));
+cclass_compiler_assert(!(sizeof(prefix) % SLAB_ALIGNMENT));
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * The huge page arena serves objects from 2 MiB aligned regions, mapped
+ * with MAP_HUGETLB when the system has huge pages reserved, or else
+ * advised with MADV_HUGEPAGE.  Each region hands out blocks from size
+ * classes (16 byte steps up to 128 bytes, then four steps per power of
+ * two) and keeps a free list per class.  Regions with free blocks of a
+ * class are linked on the arena's avail list for that class, so both
+ * allocation and free are O(1).  Free blocks are kept zeroed, but for
+ * their free list link and their size class, which make a region
+ * walkable block by block.
+ *
+ * A second, fixed arena holds the emergency reserve: regions mapped and
+ * populated up front, from which critical objects are served when the
+ * backend runs out of memory.
+ *
+ * Objects placed near another object are carved from its region, from
+ * a free block in the same or an adjacent page when one is among the
+ * first few on the free list, or else right behind the last carve.
+ */
+#ifndef DOXYGEN_SKIP
+#define REGION_SIZE ((size_t) 2 << 20)
+#define REGION_HEADER ((sizeof(region) + 63) & ~(size_t) 63)
+#define ARENA_CLASSES 44
+#define ARENA_MAX ((size_t) 64 << 10)
+#define NEAR_PAGE 4096
+#define NEAR_PROBES 8
+#define NEAR(a, b) \
+  ((size_t) (a) / NEAR_PAGE - (size_t) (b) / NEAR_PAGE + 1 <= 2)
+
+typedef struct region_tag {
+	origin origin;			/* kind and live objects     */
+	struct arena_tag *arena;	/* arena of region           */
+	struct region_tag *next;	/* next region in arena      */
+	char *bump;			/* first never used byte     */
+	bool hugetlb;			/* MAP_HUGETLB pages         */
+	bool hugepage;			/* MADV_HUGEPAGE accepted    */
+	void *free[ARENA_CLASSES];	/* free block lists          */
+	struct region_tag *avail_next[ARENA_CLASSES];
+	struct region_tag *avail_prev[ARENA_CLASSES];
+	uint64_t trim_seen;		/* activity at last trim     */
+	uint64_t trim_since;		/* ms since activity is seen */
+	size_t trim_released;		/* bytes released since      */
+} region;
+
+typedef struct arena_tag {
+	bool all;			/* serve all small objects   */
+	bool fixed;			/* no regions added on use   */
+	bool no_hugetlb;		/* MAP_HUGETLB failed before */
+	region *regions;		/* all mapped regions        */
+	region *current;		/* region to bump from       */
+	region *avail[ARENA_CLASSES];	/* regions with free blocks  */
+	size_t used;			/* bytes in live blocks      */
+} arena;
+
+static arena huge_arena;
+static arena reserve_arena = {
+	.fixed = true,
+};
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Trimming.  Each pass compares the huge page arena regions with what
+ * the previous pass saw.  A region left alone for the decay time is
+ * trimmed: unmapped when it holds no objects, or else the pages inside
+ * its free blocks are returned to the kernel.  Free blocks stay zeroed,
+ * as released pages fault back in as zero pages.  Passes run under the
+ * application's heap lock, and nothing is added to allocation or free.
+ */
+#ifndef DOXYGEN_SKIP
+static struct trim_tag {
+	pthread_t thread;		/* background trimmer        */
+	pthread_mutex_t *lock;		/* heap lock of application  */
+	pthread_mutex_t wake_lock;	/* guards stop               */
+	pthread_cond_t wake;		/* signals stop              */
+	bool running;			/* thread started            */
+	bool stop;			/* thread asked to stop      */
+	unsigned decay;			/* decay time in ms          */
+	cclass_trim_info info;		/* statistics                */
+} trim = {
+	.wake_lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Persistent heap: a file mapped shared at a fixed base address, with a
+ * header page followed by the regions of a third, fixed arena.  Objects
+ * of persistent classes live in these regions, so pointers between them
+ * stay valid across processes that map the file at the same base.  The
+ * arena itself is kept in the header.
+ *
+ * The registry of the heap is its regions themselves: attaching walks
+ * each region block by block, checks every header, and registers the
+ * live objects with this process.  Class descriptors are bound again by
+ * name through the class table in the header.
+ *
+ * A shared heap is a POSIX shared memory segment of the same layout,
+ * used by several processes at once.  Its arena is guarded by a robust,
+ * process shared mutex in the header: when a process dies holding it,
+ * the next one to lock it relinks the avail lists the dead process may
+ * have left half updated.  It is not walked when opened, as other
+ * processes may be allocating; each process registers the objects it
+ * allocates, and objects of other processes pass VERIFY() when their
+ * class descriptors are at the same address, as in processes forked
+ * from a common parent.  Only the registering process can free them.
+ */
+#ifndef DOXYGEN_SKIP
+#define PERSIST_MAGIC 0x63637068
+#define PERSIST_VERSION 3
+#define PERSIST_HEADER ((size_t) 4096)
+#define PERSIST_CLASSES 64
+#define PERSIST_NAME 48
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+typedef struct persist_header_tag {
+	unsigned magic;			/* PERSIST_MAGIC             */
+	unsigned version;		/* PERSIST_VERSION           */
+	void *base;			/* address of mapping        */
+	size_t size;			/* bytes in file             */
+	void *root;			/* root object or 0          */
+	bool shared;			/* shared memory heap        */
+	pthread_mutex_t lock;		/* arena lock of shared heap */
+	arena arena;			/* arena of heap regions     */
+	size_t classes;			/* entries in class table    */
+	struct {
+		classdesc *desc;	/* descriptor at last attach */
+		char name[PERSIST_NAME];	/* class name        */
+	} class[PERSIST_CLASSES];
+} persist_header;
+
+cclass_compiler_assert(sizeof(persist_header) <= PERSIST_HEADER);
+
+static persist_header *persist;
+
+#define PERSIST_LOCK(h) \
+  do { if ((h)->shared) persist_lock(h); } while (0)
+#define PERSIST_UNLOCK(h) \
+  do { if ((h)->shared) pthread_mutex_unlock(&(h)->lock); } while (0)
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Handle table: a dense array of object, class and generation, indexed
+ * by the low 32 bits of a handle.  The high 32 bits must match the
+ * generation of the slot, which is bumped when the object is freed, so
+ * a stale handle is caught without touching freed memory.  Free slots
+ * are chained through next.
+ */
+#ifndef DOXYGEN_SKIP
+typedef struct handle_entry_tag {
+	void *mem;			/* object or 0 if slot free  */
+	classdesc *class;		/* class descriptor or 0     */
+	unsigned generation;		/* handle generation         */
+	unsigned next;			/* next free slot + 1, or 0  */
+} handle_entry;
+
+static struct handles_tag {
+	handle_entry *entry;		/* slots                     */
+	size_t count;			/* slots in use or free      */
+	size_t size;			/* slots allocated           */
+	unsigned free;			/* first free slot + 1, or 0 */
+} handles;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Byte budgets: live block bytes (headers included) are charged against
+ * the global budget and the budget of the object's class with relaxed
+ * atomic adds.  Crossing a soft limit calls the pressure callback; when
+ * a hard limit would be exceeded, the callback gets one chance to shed
+ * load before the allocation is refused.  Critical classes are charged
+ * but never refused.  A caller in the middle of changing a heap object
+ * defers the callbacks into a budget_signal, and refuses without a
+ * second chance.
+ */
+#ifndef DOXYGEN_SKIP
+static struct budget_tag {
+	size_t budget;			/* hard limit or 0           */
+	size_t soft_limit;		/* pressure limit or 0       */
+	void (*pressure)(classdesc *, size_t);
+	size_t bytes;			/* live bytes charged        */
+} budget;
+
+typedef struct budget_signal_tag {
+	bool global;			/* call global pressure      */
+	bool own;			/* call class pressure       */
+	size_t total;			/* global bytes to report    */
+	size_t bytes;			/* class bytes to report     */
+} budget_signal;
+#endif /* DOXYGEN_SKIP */
+
+/* Allocation site (file name and line number) */
+#ifndef DOXYGEN_SKIP
+typedef struct site_tag {
+	const char *file;		/* file name ptr or 0        */
+	long line;			/* line number or 0          */
+	struct cclass_histograms_tag *latency; /* or 0       */
+} site;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * The block registry keeps one entry per live heap object in dense,
+ * fixed size chunks.  Each chunk is a structure of arrays, so that heap
+ * scans only touch the columns they need and run sequentially through
+ * memory.  A block's slot is kept in its prefix, which makes insert and
+ * remove O(1): a removed slot is refilled with the last entry.
+ */
+#ifndef DOXYGEN_SKIP
+#define CHUNK_BITS 10
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define CHUNK(index) (registry.chunk[(index) >> CHUNK_BITS])
+#define SLOT(index) ((index) & (CHUNK_SIZE - 1))
+#define PREFETCH_AHEAD 8
+#define SITE_HASH(file, line) \
+  (((size_t) (file) >> 3) ^ ((size_t) (line) * 2654435761u))
+
+/*
+ * Ownership links of an object with an owner or owned objects.  Links
+ * are kept outside the objects, so that they survive an object moving
+ * on reallocation.
+ */
+typedef struct family_tag {
+	prefix *self;			/* prefix of object          */
+	struct family_tag *parent;	/* owner or 0                */
+	struct family_tag *child;	/* first owned object or 0   */
+	struct family_tag *next;	/* next sibling or 0         */
+	struct family_tag *prev;	/* previous sibling or 0     */
+} family;
+
+typedef struct chunk_tag {
+	prefix *block[CHUNK_SIZE];	/* heap object prefixes      */
+	size_t size[CHUNK_SIZE];	/* aligned object sizes      */
+	unsigned site[CHUNK_SIZE];	/* allocation site ids       */
+	classdesc *class[CHUNK_SIZE];	/* class descriptors or 0    */
+	unsigned char pad[CHUNK_SIZE];	/* DOALIGN() padding of size */
+	family *family[CHUNK_SIZE];	/* ownership links or 0      */
+	unsigned handle[CHUNK_SIZE];	/* handle table slot + 1     */
+	unsigned stack[CHUNK_SIZE];	/* allocation stack ids      */
+} chunk;
+
+static struct registry_tag {
+	chunk **chunk;			/* chunk pointer table       */
+	size_t chunks;			/* number of chunks          */
+	size_t count;			/* number of live blocks     */
+} registry;
+
+static struct sites_tag {
+	site *site;			/* site table, id 0 unknown  */
+	size_t count;			/* number of sites in use    */
+	unsigned *hash;			/* open addressed id + 1     */
+	size_t hashsize;		/* power of two hash size    */
+} sites;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Allocation stacks.  While capture is enabled, one allocation in every
+ * period records the return addresses of its callers, from the first
+ * frame outside the library's own code.  Stacks are hash consed: each
+ * distinct stack is stored once, its frames in a shared pool, and
+ * blocks keep the stack id in the registry.
+ */
+#ifndef DOXYGEN_SKIP
+#define STACK_DEPTH 32
+#define STACK_SKIP 8
+#define STACK_SAMPLE() \
+  (stacks.depth && !--stacks.countdown ? stack_capture() : 0)
+
+typedef struct stack_tag {
+	size_t frame;			/* first frame in pool       */
+	unsigned depth;			/* number of frames          */
+	unsigned hash;			/* hash of frames            */
+} stack;
+
+static struct stacks_tag {
+	stack *stack;			/* stack table, id 0 none    */
+	size_t count;			/* number of stacks in use   */
+	unsigned *hash;			/* open addressed id + 1     */
+	size_t hashsize;		/* power of two hash size    */
+	void **frame;			/* frames of all stacks      */
+	size_t frames;			/* frames in use             */
+	size_t frame_size;		/* frames allocated          */
+	unsigned depth;			/* frames to capture, 0 off  */
+	unsigned period;		/* allocations per capture   */
+	unsigned countdown;		/* allocations to capture    */
+	size_t text;			/* start of library code     */
+	size_t text_size;		/* size of library code, 0   */
+} stacks;
+#endif /* DOXYGEN_SKIP */
+
+/* Backend allocator for heap object memory */
+#ifndef DOXYGEN_SKIP
+static const cclass_backend libc_backend = {
+	.malloc = malloc,
+	.realloc = realloc,
+	.free = free,
+	.usable_size = malloc_usable_size,
+};
+
+static const cclass_backend *backend = &libc_backend;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Published heap metrics.  A class descriptor caches its metrics slot
+ * together with the publication it belongs to, so that slots are
+ * assigned afresh when metrics are published again.
+ */
+#ifndef DOXYGEN_SKIP
+#define METRICS_SLOT_BITS 8
+#define METRICS(class, id, n, bytes) \
+  do { if (metrics) metrics_count(class, id, n, bytes); } while (0)
+cclass_compiler_assert(CCLASS_METRICS_CLASSES <= 1 << METRICS_SLOT_BITS);
+
+static cclass_metrics *metrics = 0;
+static unsigned metrics_epoch = 0;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Allocation trace.  Each thread appends events to its own buffer,
+ * mapped on first use and never released, and writes the buffer to the
+ * trace file when it fills.  A class is named once per trace.
+ */
+#ifndef DOXYGEN_SKIP
+#define TRACE_EVENTS 4096
+#define TRACE(op, class, id, mem, old, size) \
+  do { if (trace.fd >= 0) trace_event(op, class, id, mem, old, size); } \
+  while (0)
+
+typedef struct trace_buffer_tag {
+	struct trace_buffer_tag *next;	/* next buffer of any thread */
+	uint32_t thread;		/* thread id                 */
+	size_t count;			/* number of events          */
+	cclass_trace_event event[TRACE_EVENTS];
+} trace_buffer;
+
+static struct trace_tag {
+	int fd;				/* trace file or -1          */
+	unsigned epoch;			/* trace number              */
+	struct timespec start;		/* trace start time          */
+	trace_buffer *buffers;		/* buffers of all threads    */
+} trace = { .fd = -1 };
+
+static __thread trace_buffer *trace_local;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Latency histograms.  Times are counted in time stamp counter ticks in
+ * log-linear buckets, LATENCY_SUB buckets per power of two, so that a
+ * bucket is at most 1/8 as wide as its values.  Ticks are converted to
+ * nanoseconds on readout.  Histograms of a class or site are allocated
+ * on its first timed call, and linked for the report.
+ */
+#ifndef DOXYGEN_SKIP
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_EXP_MAX 40
+#define LATENCY_BUCKETS \
+  ((LATENCY_EXP_MAX - LATENCY_SUB_BITS + 2) * LATENCY_SUB)
+#define LATENCY_START(t) uint64_t t = (latency.enabled ? ticks() : 0)
+#define LATENCY(class, id, op, t) \
+  do { if (t) latency_count(class, id, op, ticks() - (t), 1); } while (0)
+#define LATENCY_BATCH(class, id, op, t, n) \
+  do { if (t) latency_count(class, id, op, (ticks() - (t)) / (n), n); } \
+  while (0)
+
+typedef struct histogram_tag {
+	uint64_t count;			/* number of timed calls     */
+	uint64_t max;			/* slowest call in ticks     */
+	uint64_t bucket[LATENCY_BUCKETS];
+} histogram;
+
+struct cclass_histograms_tag {
+	histogram op[CCLASS_LATENCY_OPS]; /* per heap operation      */
+	classdesc *class;		/* class, or 0 for a site    */
+	unsigned site;			/* site id of a site         */
+	struct cclass_histograms_tag *next; /* next class or site    */
+};
+
+static struct latency_tag {
+	bool enabled;			/* timing heap operations    */
+	double ns_per_tick;		/* calibrated tick length    */
+	struct cclass_histograms_tag all; /* all objects            */
+	struct cclass_histograms_tag *list; /* classes and sites     */
+} latency;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Interned strings.  Each string is a heap object of class "intern",
+ * holding its reference count and hash ahead of the characters, and is
+ * found through an open addressed table of string pointers.  Like the
+ * rest of the heap, the table and reference counts are not thread safe.
+ */
+#ifndef DOXYGEN_SKIP
+typedef struct interned_tag {
+	size_t refs;			/* number of references      */
+	size_t hash;			/* hash of string            */
+	char str[];			/* string                    */
+} interned;
+
+#define INTERNED(s) \
+  ((interned *) ((char *) (s) - offsetof(interned, str)))
+
+static classdesc intern_classdesc = { .name = "intern" };
+
+static struct intern_tag {
+	const char **table;		/* open addressed strings    */
+	size_t size;			/* power of two table size   */
+	cclass_intern_info info;	/* statistics                */
+} intern;
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Warm-up profile.  The peaks of a known set of classes are written to
+ * a file at exit, and read back at the next start to reserve room for
+ * as many objects before the first allocation.
+ */
 #ifndef DOXYGEN_SKIP
-static prefix *heap = 0;
+static struct profile_tag {
+	char *path;			/* profile file or 0         */
+	classdesc **classes;		/* classes to profile        */
+	size_t n;			/* number of classes         */
+} profile;
 #endif /* DOXYGEN_SKIP */
 
 /* Local prototypes */
 
 /**
- * @brief Add heap object to linked list)
+ * @brief Add heap object to block registry
  *
- * Add the given heap object into the doubly linked list of heap
- * objects
+ * Append the given heap object to the block registry and record its
+ * slot in the object prefix.
  *
  * @param p  prefix pointer to heap object
+ * @param size  aligned size of the object
+ * @param pad  bytes added to the requested size by alignment
+ * @param id  allocation site id
+ *
+ * @return true on success, or false if the registry could not grow
+ */
+static bool registry_insert(prefix *p, size_t size, size_t pad,
+			    unsigned id);
+
+/**
+ * @brief Reserve block registry entries
+ *
+ * Make sure the block registry can take another n objects without
+ * growing.
+ *
+ * @param n  number of entries to reserve
+ *
+ * @return true on success, or false if the registry could not grow
  */
-static void list_insert(prefix *p);
+static bool registry_reserve(size_t n);
 
 /**
- * @brief Remove heap object from linked list)
+ * @brief Remove heap object from block registry
  *
- * Remove the given heap object from the doubly linked list of heap
- * objects
+ * Remove the given heap object from the block registry, by moving the
+ * last registry entry into its slot.
  *
  * @param p  prefix pointer to heap object
  */
-static void list_remove(prefix *p);
+static void registry_remove(prefix *p);
 
 /**
- * @brief Verify heap pointer)
+ * @brief Allocate heap object memory
  *
- * Verify that a pointer points into that heap to a valid object in the
- * heap
+ * Allocate memory for a heap object from the huge page arena, if
+ * selected for the object, or else from the backend.  The origin of the
+ * object is set.  The object is zeroed, unless its class has an init
+ * hook and the memory does not come zeroed from the arena.  Objects
+ * placed near an object in the huge page arena go in its region, as
+ * close to it as the region allows, when it has room.
  *
- * @param p  heap pointer to validate
+ * @param size  aligned size of the object
+ * @param class  class descriptor ptr or 0
+ * @param near  prefix of heap object to place the object near, or 0
  *
- * @return heap pointer is valid (true) or not (false)
+ * @return prefix pointer to heap object or 0
  */
-static bool list_verify(void *p);
+static prefix *block_alloc(size_t size, classdesc *class, prefix *near);
 
 /**
- * @brief Render description of heap object)
+ * @brief Allocate and register heap object
  *
- * Render a text description for the given heap object
+ * The body of cclass_malloc(), with an object to place the object near.
+ *
+ * @param size  size of the object
+ * @param class  class descriptor ptr or 0
+ * @param near  prefix of heap object to place the object near, or 0
+ * @param file  source file name of the allocation
+ * @param line  source line number of the allocation
+ *
+ * @return address of object or 0
+ */
+static void *object_alloc(size_t size, classdesc *class, prefix *near,
+			  const char *file, int line);
+
+/**
+ * @brief Unregister and release heap object
+ *
+ * Everything cclass_free() does for one object, except calling the fini
+ * hook.  The object is unlinked from its owner.
+ *
+ * @param p  prefix of object without owned objects
+ */
+static void object_free(prefix *p);
+
+/**
+ * @brief Drop ownership links of heap object
+ *
+ * Unlink the object from its owner and release its links.
+ *
+ * @param p  prefix of object without owned objects
+ */
+static void family_drop(prefix *p);
+
+/**
+ * @brief Check or attach the regions of a persistent heap
+ *
+ * Walk every region block by block.  When checking, verify the block
+ * headers and that each object's class can be bound to one of classes.
+ * When attaching, rebuild the free lists and register the live objects.
+ *
+ * @param h  persistent heap header
+ * @param classes  class descriptors to bind by name
+ * @param n  number of class descriptors
+ * @param attach  false to check only, true to attach
+ *
+ * @return true if the heap is consistent and, when attaching, all its
+ * objects were registered
+ */
+static bool persist_walk(persist_header *h, classdesc **classes, size_t n,
+			 bool attach);
+
+/**
+ * @brief Bind the class of a persistent object
+ *
+ * @param h  persistent heap header
+ * @param class  class descriptor stored in the object
+ * @param classes  class descriptors to bind by name
+ * @param n  number of class descriptors
+ *
+ * @return class descriptor of this process, or 0
+ */
+static classdesc *persist_bind(persist_header *h, classdesc *class,
+			       classdesc **classes, size_t n);
+
+/**
+ * @brief Unregister the objects of a persistent heap
+ *
+ * The objects stay in the file; only this process forgets them.
+ *
+ * @param h  persistent heap header
+ */
+static void persist_detach(persist_header *h);
+
+/**
+ * @brief Lock the arena of a shared heap
+ *
+ * When the previous owner died holding the lock, relink the avail lists
+ * from the free lists of the regions, and mark the lock consistent.  A
+ * block the owner was pushing or popping at the time is lost.
+ *
+ * @param h  shared heap header
+ */
+static void persist_lock(persist_header *h);
+
+/**
+ * @brief Map and open a persistent or shared heap
+ *
+ * @param fd  file descriptor of heap file or segment, closed on return
+ * @param create  lay out a new heap if the file has none yet
+ * @param shared  true for a shared heap
+ * @param base  address to map the file at
+ * @param size  bytes in a new file
+ * @param classes  classes of the objects in the file
+ * @param n  number of classes
+ *
+ * @return true if the heap was opened
+ */
+static bool persist_map(int fd, bool create, bool shared, void *base,
+			size_t size, classdesc **classes, size_t n);
+
+/**
+ * @brief Release handle table slot of heap object
+ *
+ * Bump the generation of the slot, so that the handle turns stale.
+ *
+ * @param p  prefix of object
+ */
+static void handle_release(prefix *p);
+
+/**
+ * @brief Get ownership links of heap object
+ *
+ * @param p  prefix of object
+ * @param create  create the links if the object has none
+ *
+ * @return ownership links or 0
+ */
+static family *family_get(prefix *p, bool create);
+
+/**
+ * @brief Release heap object memory
+ *
+ * Clear the memory of a heap object that is no longer in the block
+ * registry, and return it to its slab, arena region or to the system.
  *
  * @param p  prefix pointer to heap object
- * @param buffer  where to place text description
+ * @param size  aligned size of the object
  */
-static void render(prefix *p, char *buffer);
+static void block_free(prefix *p, size_t size);
+
+/**
+ * @brief Drop a reference to a shared heap object
+ *
+ * Drop the caller's reference when other holders remain, so that one
+ * holder freeing an object does not free it under the others.
+ *
+ * @param p  prefix pointer to a live heap object
+ *
+ * @return true if a reference was dropped and the object lives on,
+ * false if the caller holds the last reference
+ */
+static bool object_unshare(prefix *p);
+
+/**
+ * @brief Release heap objects of one origin
+ *
+ * As block_free(), for n objects that share their origin: the persistent
+ * heap is locked once, and a slab is released once for the whole run.
+ *
+ * @param run  prefix ptrs of heap objects, each with its postfix intact
+ * @param n  number of objects
+ */
+static void block_free_run(void **run, size_t n);
+
+/**
+ * @brief Order heap objects by origin, then by address
+ *
+ * qsort() comparison function for block_free_run().
+ *
+ * @param a  ptr to first prefix ptr, as void ptr
+ * @param b  ptr to second prefix ptr, as void ptr
+ *
+ * @return <0, 0 or >0
+ */
+static int block_order(const void *a, const void *b);
+
+/**
+ * @brief Allocate a batch slab from the backend
+ *
+ * @param n  number of blocks in the slab
+ * @param stride  bytes per block
+ * @param class  class descriptor ptr or 0; without init hook the slab
+ *   is zeroed
+ *
+ * @return slab origin ptr, or 0 if out of memory
+ */
+static origin *slab_alloc(size_t n, size_t stride, classdesc *class);
+
+/**
+ * @brief Get block from an arena
+ *
+ * @param a  arena to allocate from
+ * @param total  number of bytes needed, at most ARENA_MAX
+ * @param r  where to place the region of the block
+ *
+ * @return zeroed block or 0 if the arena is exhausted
+ */
+static void *arena_get(arena *a, size_t total, region **r);
+
+/**
+ * @brief Get block from a given arena region
+ *
+ * @param r  region to allocate from
+ * @param total  number of bytes needed, at most ARENA_MAX
+ * @param hint  address in r to place the block close to
+ *
+ * @return zeroed block or 0 if the region has no room
+ */
+static void *arena_get_near(region *r, size_t total, void *hint);
+
+/**
+ * @brief Return block to its arena region
+ *
+ * @param r  region of the block
+ * @param block  zeroed block
+ * @param total  number of bytes requested for the block
+ */
+static void arena_put(region *r, void *block, size_t total);
+
+/**
+ * @brief Write profile at exit
+ */
+static void profile_exit(void);
+
+/**
+ * @brief Fill arena free list ahead of allocation
+ *
+ * Carve blocks and return them to their regions' free lists, touching
+ * every page, so that later allocations neither map nor fault memory.
+ *
+ * @param a  arena to fill
+ * @param total  number of bytes requested per block
+ * @param n  number of blocks
+ *
+ * @return number of blocks placed on free lists
+ */
+static size_t arena_reserve(arena *a, size_t total, size_t n);
+
+/**
+ * @brief Is the huge page arena used for an object?
+ *
+ * @param class  class descriptor ptr or 0
+ * @param size  aligned size of the object
+ *
+ * @return true if the object is to be allocated from the arena
+ */
+static bool arena_selects(classdesc *class, size_t size);
+
+/**
+ * @brief Size class of an arena block
+ *
+ * @param total  number of bytes needed, at most ARENA_MAX
+ *
+ * @return size class index
+ */
+static unsigned arena_class(size_t total);
+
+/**
+ * @brief Block size of an arena size class
+ *
+ * @param c  size class index
+ *
+ * @return number of bytes in blocks of the class
+ */
+static size_t arena_class_size(unsigned c);
+
+/**
+ * @brief Map a new arena region
+ *
+ * @param a  arena to add the region to
+ *
+ * @return new region, or 0 if the mapping failed
+ */
+static region *region_map(arena *a);
+
+/**
+ * @brief Activity of an arena region
+ *
+ * @param r  region
+ *
+ * @return a value that changes when blocks of r are handed out or freed
+ */
+static uint64_t region_activity(region *r);
+
+/**
+ * @brief Release the pages inside free blocks of an arena region
+ *
+ * The first page of each free block holds its free list link, and is
+ * kept.
+ *
+ * @param r  region
+ * @param page  page size
+ *
+ * @return number of bytes released
+ */
+static size_t region_trim(region *r, size_t page);
+
+/**
+ * @brief Unlink an empty arena region and unmap it
+ *
+ * @param link  link to the region in its arena's region list
+ */
+static void region_unmap(region **link);
+
+/**
+ * @brief Background trimmer
+ *
+ * @param arg  unused
+ *
+ * @return 0
+ */
+static void *trim_main(void *arg);
+
+/**
+ * @brief Count objects in published metrics
+ *
+ * Add allocated (n > 0) or freed (n < 0) objects, or a size change
+ * (n == 0), to the total, class and site counters.
+ *
+ * @param class  class descriptor ptr or 0
+ * @param id  allocation site id
+ * @param n  number of objects allocated, or minus the number freed
+ * @param bytes  change in live bytes
+ */
+static void metrics_count(classdesc *class, unsigned id, long n,
+			  long bytes);
+
+/**
+ * @brief Name a site in published metrics
+ *
+ * @param id  allocation site id
+ */
+static void metrics_site(unsigned id);
+
+/**
+ * @brief Record an event in the allocation trace
+ *
+ * @param op  CCLASS_TRACE_MALLOC, CCLASS_TRACE_REALLOC or
+ * CCLASS_TRACE_FREE
+ * @param class  class descriptor ptr or 0
+ * @param id  allocation site id
+ * @param mem  heap object
+ * @param old  previous heap object of a reallocated one, or 0
+ * @param size  aligned payload size
+ */
+static void trace_event(cclass_trace_op op, classdesc *class, unsigned id,
+			void *mem, void *old, size_t size);
+
+/**
+ * @brief Name a site or class in the allocation trace
+ *
+ * @param op  CCLASS_TRACE_SITE or CCLASS_TRACE_CLASS
+ * @param id  site id or class id
+ * @param size  line of site or flags of class
+ * @param name  file name of site or class name
+ */
+static void trace_name(cclass_trace_op op, uint64_t id, uint64_t size,
+		       const char *name);
+
+/**
+ * @brief Get a trace buffer with room for events
+ *
+ * @param n  number of events needed
+ *
+ * @return buffer of the calling thread, or 0
+ */
+static trace_buffer *trace_room(size_t n);
+
+/**
+ * @brief Write a trace buffer to the trace file
+ *
+ * @param b  trace buffer
+ */
+static void trace_flush(trace_buffer *b);
+
+/**
+ * @brief Read the time stamp counter
+ *
+ * @return ticks, or nanoseconds where there is no time stamp counter
+ */
+static uint64_t ticks(void);
+
+/**
+ * @brief Count a timed heap operation
+ *
+ * @param class  class descriptor ptr or 0
+ * @param id  allocation site id
+ * @param op  heap operation
+ * @param t  time taken in ticks, by each call
+ * @param n  number of calls
+ */
+static void latency_count(classdesc *class, unsigned id,
+			  cclass_latency_op op, uint64_t t, uint64_t n);
+
+/**
+ * @brief Get the histograms of a class or site
+ *
+ * @param slot  histograms ptr of the class or site
+ * @param class  class descriptor ptr, or 0 for a site
+ * @param id  site id of a site
+ *
+ * @return histograms, or 0 if out of memory
+ */
+static struct cclass_histograms_tag *
+latency_histograms(struct cclass_histograms_tag **slot, classdesc *class,
+		   unsigned id);
+
+/**
+ * @brief Upper bound of a histogram bucket
+ *
+ * @param index  bucket index
+ *
+ * @return largest number of ticks counted in the bucket
+ */
+static uint64_t bucket_bound(size_t index);
+
+/**
+ * @brief Read latency percentiles from a histogram
+ *
+ * @param h  histogram
+ * @param info  where to place the percentiles
+ *
+ * @return true if calls were timed
+ */
+static bool latency_read(const histogram *h, cclass_latency_info *info);
+
+/**
+ * @brief Find the table slot of an interned string
+ *
+ * @param s  string
+ * @param hash  hash of s
+ *
+ * @return slot of s, or the empty slot where it belongs
+ */
+static size_t intern_slot(const char *s, size_t hash);
+
+/**
+ * @brief Add a registry entry to a memory overhead account
+ *
+ * @param o  memory overhead account
+ * @param c  registry chunk
+ * @param slot  slot of entry in chunk
+ */
+static void overhead_add(cclass_overhead *o, chunk *c, size_t slot);
+
+/**
+ * @brief Work out the fragmentation of a memory overhead account
+ *
+ * @param o  memory overhead account
+ */
+static void overhead_ratio(cclass_overhead *o);
+
+/**
+ * @brief Charge bytes against the budgets
+ *
+ * @param class  class descriptor ptr or 0
+ * @param bytes  number of bytes to charge
+ * @param defer  where to record pressure callbacks for budget_signal(),
+ *   or 0 to call them (and retry once over a hard limit) right away
+ *
+ * @return true if charged, or false if a budget refused the bytes
+ */
+static bool budget_charge(classdesc *class, size_t bytes,
+			  budget_signal *defer);
+
+/**
+ * @brief Call pressure callbacks deferred by budget_charge()
+ *
+ * @param class  class descriptor ptr or 0, as charged
+ * @param s  deferred callbacks
+ */
+static void budget_signal_call(classdesc *class, budget_signal *s);
+
+/**
+ * @brief Return charged bytes to the budgets
+ *
+ * @param class  class descriptor ptr or 0
+ * @param bytes  number of bytes to return
+ */
+static void budget_uncharge(classdesc *class, size_t bytes);
+
+/**
+ * @brief Reserve class object entries
+ *
+ * Make sure the live object index of a class can take another n objects
+ * without growing.
+ *
+ * @param class  class descriptor ptr or 0
+ * @param n  number of entries to reserve
+ *
+ * @return true on success, or false if the index could not grow
+ */
+static bool class_reserve(classdesc *class, size_t n);
+
+/**
+ * @brief Add heap object to its class
+ *
+ * Append the given heap object to the live object index of its class,
+ * which must have room reserved.
+ *
+ * @param p  prefix pointer to heap object
+ */
+static void class_insert(prefix *p);
+
+/**
+ * @brief Remove heap object from its class
+ *
+ * Remove the given heap object from the live object index of its class,
+ * by moving the last entry into its slot.
+ *
+ * @param p  prefix pointer to heap object
+ */
+static void class_remove(prefix *p);
+
+/**
+ * @brief Verify heap pointer
+ *
+ * Verify that a pointer points into that heap to a valid object in the
+ * heap
+ *
+ * @param p  heap pointer to validate
+ *
+ * @return heap pointer is valid (true) or not (false)
+ */
+static bool list_verify(void *p);
+
+/**
+ * @brief Render description of heap object
+ *
+ * Render a text description for the given heap object
+ *
+ * @param p  prefix pointer to heap object
+ * @param buffer  where to place text description
+ */
+static void render(prefix *p, char *buffer);
+
+/**
+ * @brief Grow site table
+ *
+ * Double the site hash and table, creating site 0 (unknown site) on first
+ * use.
+ *
+ * @return true if the table grew, false if out of memory
+ */
+static bool site_grow(void);
+
+/**
+ * @brief Look up allocation site
+ *
+ * Find (or add) the site id for the given file name and line number.
+ *
+ * @param file  file name ptr or 0
+ * @param line  line number or 0
+ *
+ * @return site id, or 0 (unknown site) if the site table could not grow
+ */
+static unsigned site_lookup(const char *file, long line);
+
+/**
+ * @brief Capture allocation stack
+ *
+ * Record the callers of the allocation, and restart the countdown to
+ * the next capture.
+ *
+ * @return stack id, or 0 (no stack) if the stack table could not grow
+ */
+static unsigned stack_capture(void);
+
+/**
+ * @brief Find the code of the library
+ *
+ * dl_iterate_phdr() callback: set the range of library code skipped by
+ * stack_capture() to the executable segment of the shared object that
+ * holds it.  Linked into the program itself, the library has no range
+ * of its own, and none is set.
+ *
+ * @param info  loaded object
+ * @param size  size of info
+ * @param data  unused
+ *
+ * @return nonzero once the library is found
+ */
+static int stack_text(struct dl_phdr_info *info, size_t size, void *data);
+
+/**
+ * @brief Look up allocation stack
+ *
+ * Find (or add) the stack id for the given frames.
+ *
+ * @param frame  return addresses, innermost first
+ * @param depth  number of frames
+ *
+ * @return stack id, or 0 (no stack) if the stack table could not grow
+ */
+static unsigned stack_lookup(void **frame, unsigned depth);
+
+bool
+registry_insert(prefix *p, size_t size, size_t pad, unsigned id)
+{
+	size_t index = registry.count;
+
+	if (!registry_reserve(1)) {
+		return false;
+	}
+
+	CHUNK(index)->block[SLOT(index)] = p;
+	CHUNK(index)->size[SLOT(index)] = size;
+	CHUNK(index)->site[SLOT(index)] = id;
+	CHUNK(index)->class[SLOT(index)] = p->class;
+	CHUNK(index)->pad[SLOT(index)] = pad;
+	CHUNK(index)->family[SLOT(index)] = 0;
+	CHUNK(index)->handle[SLOT(index)] = 0;
+	CHUNK(index)->stack[SLOT(index)] = 0;
+	p->index = index;
+	registry.count++;
+
+	return true;
+}
+
+bool
+registry_reserve(size_t n)
+{
+	size_t chunks = (registry.count + n + CHUNK_SIZE - 1) >> CHUNK_BITS;
+
+	/* Site 0 must exist before any block refers to it */
+	if (!sites.site && !site_grow()) {
+		return false;
+	}
+
+	/* Grow chunk table and add chunks in one go */
+	if (chunks > registry.chunks) {
+		chunk **table;
+		table = (chunk **) realloc(registry.chunk,
+					   chunks * sizeof(chunk *));
+		if (!table) {
+			return false;
+		}
+		registry.chunk = table;
+		while (registry.chunks < chunks) {
+			chunk *c = (chunk *) malloc(sizeof(chunk));
+			if (!c) {
+				return false;
+			}
+			registry.chunk[registry.chunks++] = c;
+		}
+	}
+
+	return true;
+}
+
+void
+registry_remove(prefix *p)
+{
+	size_t index = p->index;
+	size_t last = --registry.count;
+
+	/* Fill hole with last entry */
+	if (index != last) {
+		chunk *to = CHUNK(index);
+		chunk *from = CHUNK(last);
+		to->block[SLOT(index)] = from->block[SLOT(last)];
+		to->size[SLOT(index)] = from->size[SLOT(last)];
+		to->site[SLOT(index)] = from->site[SLOT(last)];
+		to->class[SLOT(index)] = from->class[SLOT(last)];
+		to->pad[SLOT(index)] = from->pad[SLOT(last)];
+		to->family[SLOT(index)] = from->family[SLOT(last)];
+		to->handle[SLOT(index)] = from->handle[SLOT(last)];
+		to->stack[SLOT(index)] = from->stack[SLOT(last)];
+		to->block[SLOT(index)]->index = index;
+	}
+
+	/* Release trailing chunk once a whole chunk below it is free */
+	if (registry.chunks > 1 &&
+	    last + 2 * CHUNK_SIZE <= registry.chunks * CHUNK_SIZE) {
+		free(registry.chunk[--registry.chunks]);
+	}
+}
+
+prefix *
+block_alloc(size_t size, classdesc *class, prefix *near)
+{
+	prefix *p = 0;
+	region *r = 0;
+
+	/* Persistent objects only ever live in the mapped file */
+	if (persist && class && (class->flags & CCLASS_PERSISTENT)) {
+		if (BLOCKSIZE(size) <= ARENA_MAX) {
+			PERSIST_LOCK(persist);
+			p = (prefix *) arena_get(&persist->arena,
+						 BLOCKSIZE(size), &r);
+			PERSIST_UNLOCK(persist);
+		}
+		if (p) {
+			p->origin = &r->origin;
+		}
+		return p;
+	}
+
+	/* Same huge page region as the near object, when it has room */
+	if (near && near->origin && near->origin->kind == ORIGIN_REGION &&
+	    ((region *) near->origin)->arena == &huge_arena &&
+	    BLOCKSIZE(size) <= ARENA_MAX) {
+		r = (region *) near->origin;
+		p = (prefix *) arena_get_near(r, BLOCKSIZE(size), near);
+	}
+	if (!p && arena_selects(class, size)) {
+		p = (prefix *) arena_get(&huge_arena, BLOCKSIZE(size), &r);
+	}
+
+	/* Backend, also when no arena region could be mapped */
+	if (!p) {
+		p = (prefix *) backend->malloc(BLOCKSIZE(size));
+		if (p) {
+			p->origin = 0;
+			if (!class || !class->init) {
+				memset(p + 1, 0, size);
+			}
+			return p;
+		}
+	}
+
+	/* Emergency reserve for critical objects */
+	if (!p && class && (class->flags & CCLASS_CRITICAL) &&
+	    BLOCKSIZE(size) <= ARENA_MAX) {
+		p = (prefix *) arena_get(&reserve_arena, BLOCKSIZE(size), &r);
+	}
+	if (p) {
+		p->origin = &r->origin;
+	}
+
+	return p;
+}
+
+void
+block_free(prefix *p, size_t size)
+{
+	origin *o = p->origin;
+
+	memset(p, 0, BLOCKSIZE(size));
+	if (!o) {
+		backend->free(p);
+	} else if (o->kind == ORIGIN_REGION && persist &&
+		   ((region *) o)->arena == &persist->arena) {
+		PERSIST_LOCK(persist);
+		arena_put((region *) o, p, BLOCKSIZE(size));
+		PERSIST_UNLOCK(persist);
+	} else if (o->kind == ORIGIN_REGION) {
+		arena_put((region *) o, p, BLOCKSIZE(size));
+	} else if (!--o->live) {
+		backend->free(o);
+	}
+}
+
+void
+block_free_run(void **run, size_t n)
+{
+	origin *o = ((prefix *) run[0])->origin;
+	bool locked = (o && o->kind == ORIGIN_REGION && persist &&
+		       ((region *) o)->arena == &persist->arena);
+
+	if (locked) {
+		PERSIST_LOCK(persist);
+	}
+	for (size_t i = 0; i < n; i++) {
+		prefix *p = (prefix *) run[i];
+		size_t total = BLOCKSIZE((char *) p->postfix - (char *) (p + 1));
+		memset(p, 0, total);
+		if (!o) {
+			backend->free(p);
+		} else if (o->kind == ORIGIN_REGION) {
+			arena_put((region *) o, p, total);
+		}
+	}
+	if (locked) {
+		PERSIST_UNLOCK(persist);
+	}
+	if (o && o->kind == ORIGIN_SLAB && !(o->live -= n)) {
+		backend->free(o);
+	}
+}
+
+int
+block_order(const void *a, const void *b)
+{
+	const prefix *p = *(void * const *) a;
+	const prefix *q = *(void * const *) b;
+
+	if (p->origin != q->origin) {
+		return ((size_t) p->origin < (size_t) q->origin ? -1 : 1);
+	}
+
+	return (p < q ? -1 : p > q);
+}
+
+origin *
+slab_alloc(size_t n, size_t stride, classdesc *class)
+{
+	origin *s = (origin *) backend->malloc(sizeof(origin) + n * stride);
+
+	if (s) {
+		if (!class || !class->init) {
+			memset(s, 0, sizeof(origin) + n * stride);
+		}
+		s->kind = ORIGIN_SLAB;
+		s->live = n;
+	}
+
+	return s;
+}
+
+void *
+arena_get(arena *a, size_t total, region **rp)
+{
+	unsigned c = arena_class(total);
+	size_t bytes = arena_class_size(c);
+	region *r = a->avail[c];
+	void *block;
+
+	if (r) {
+		/* Pop free block, unlink region once it has no more */
+		block = r->free[c];
+		r->free[c] = *(void **) block;
+		((void **) block)[0] = 0;
+		((size_t *) block)[1] = 0;
+		if (!r->free[c]) {
+			if (r->avail_next[c]) {
+				r->avail_next[c]->avail_prev[c] = 0;
+			}
+			a->avail[c] = r->avail_next[c];
+		}
+	} else {
+		/* Carve from current region, or next one with room */
+		r = a->current;
+		if (!r ||
+		    (size_t) ((char *) r + REGION_SIZE - r->bump) < bytes) {
+			if (a->fixed) {
+				r = a->regions;
+				while (r && (size_t) ((char *) r + REGION_SIZE -
+						      r->bump) < bytes) {
+					r = r->next;
+				}
+			} else {
+				r = region_map(a);
+			}
+			if (!r) {
+				return 0;
+			}
+			a->current = r;
+		}
+		block = r->bump;
+		r->bump += bytes;
+	}
+
+	r->origin.live++;
+	a->used += bytes;
+	*rp = r;
+
+	return block;
+}
+
+void *
+arena_get_near(region *r, size_t total, void *hint)
+{
+	unsigned c = arena_class(total);
+	size_t bytes = arena_class_size(c);
+	bool room = ((size_t) ((char *) r + REGION_SIZE - r->bump) >= bytes);
+	arena *a = r->arena;
+	void **link = &r->free[c];
+	void *block;
+
+	/* Free block next to the hint, else carve next to it, else any */
+	for (int probe = 0; *link && probe < NEAR_PROBES &&
+	     !NEAR(*link, hint); probe++) {
+		link = (void **) *link;
+	}
+	if (!*link || !NEAR(*link, hint)) {
+		link = ((room && NEAR(r->bump, hint)) || !r->free[c] ? 0 :
+			&r->free[c]);
+	}
+
+	if (link) {
+		/* Unlink free block, and region once it has no more */
+		block = *link;
+		*link = *(void **) block;
+		((void **) block)[0] = 0;
+		((size_t *) block)[1] = 0;
+		if (!r->free[c]) {
+			if (r->avail_prev[c]) {
+				r->avail_prev[c]->avail_next[c] =
+				    r->avail_next[c];
+			} else {
+				a->avail[c] = r->avail_next[c];
+			}
+			if (r->avail_next[c]) {
+				r->avail_next[c]->avail_prev[c] =
+				    r->avail_prev[c];
+			}
+			r->avail_next[c] = r->avail_prev[c] = 0;
+		}
+	} else if (room) {
+		block = r->bump;
+		r->bump += bytes;
+	} else {
+		return 0;
+	}
+
+	r->origin.live++;
+	a->used += bytes;
+
+	return block;
+}
+
+void
+arena_put(region *r, void *block, size_t total)
+{
+	unsigned c = arena_class(total);
+	arena *a = r->arena;
+
+	/* Link region on avail list with its first free block */
+	if (!r->free[c]) {
+		r->avail_prev[c] = 0;
+		r->avail_next[c] = a->avail[c];
+		if (a->avail[c]) {
+			a->avail[c]->avail_prev[c] = r;
+		}
+		a->avail[c] = r;
+	}
+	((void **) block)[0] = r->free[c];
+	((size_t *) block)[1] = c + 1;
+	r->free[c] = block;
+
+	r->origin.live--;
+	a->used -= arena_class_size(c);
+}
+
+size_t
+arena_reserve(arena *a, size_t total, size_t n)
+{
+	size_t bytes = arena_class_size(arena_class(total));
+	void **chain = 0;
+	size_t i;
+
+	/* Carve all blocks first, chained through their first two words */
+	for (i = 0; i < n; i++) {
+		region *r;
+		void **block = (void **) arena_get(a, total, &r);
+		if (!block) {
+			break;
+		}
+		for (size_t page = 4096; page < bytes; page += 4096) {
+			((volatile char *) block)[page] = 0;
+		}
+		block[0] = chain;
+		block[1] = r;
+		chain = block;
+	}
+	while (chain) {
+		void **block = chain;
+		region *r = (region *) block[1];
+		chain = (void **) block[0];
+		arena_put(r, block, total);
+	}
+
+	return i;
+}
+
+bool
+arena_selects(classdesc *class, size_t size)
+{
+	return (BLOCKSIZE(size) <= ARENA_MAX &&
+		(huge_arena.all ||
+		 (class && (class->flags & CCLASS_HUGEPAGE))));
+}
+
+unsigned
+arena_class(size_t total)
+{
+	unsigned k;
+
+	if (total <= 128) {
+		return (total + 15) / 16 - 1;
+	}
+
+	/* total in (2^k, 2^(k+1)], split in four steps */
+	k = 8 * sizeof(long) - 1 - __builtin_clzl(total - 1);
+	return 8 + (k - 7) * 4 + ((total - 1 - ((size_t) 1 << k)) >> (k - 2));
+}
+
+size_t
+arena_class_size(unsigned c)
+{
+	unsigned k;
+
+	if (c < 8) {
+		return (c + 1) * 16;
+	}
+
+	k = 7 + (c - 8) / 4;
+	return ((size_t) 1 << k) +
+	       ((c - 8) % 4 + 1) * ((size_t) 1 << (k - 2));
+}
+
+region *
+region_map(arena *a)
+{
+	int populate = (a->fixed ? MAP_POPULATE : 0);
+	char *base = MAP_FAILED;
+	bool hugetlb = false;
+	bool hugepage = false;
+	region *r;
+
+#ifdef MAP_HUGETLB
+	/* Reserved huge pages, remember when there are none */
+	if (!a->no_hugetlb) {
+		base = mmap(0, REGION_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			    populate, -1, 0);
+		hugetlb = (base != MAP_FAILED);
+		a->no_hugetlb = !hugetlb;
+	}
+#endif
+
+	/* Else over-map normal pages, and trim to 2 MiB alignment */
+	if (base == MAP_FAILED) {
+		char *raw = mmap(0, 2 * REGION_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED) {
+			return 0;
+		}
+		base = (char *) (((size_t) raw + REGION_SIZE - 1) &
+				 ~(REGION_SIZE - 1));
+		if (base != raw) {
+			munmap(raw, base - raw);
+		}
+		munmap(base + REGION_SIZE, raw + REGION_SIZE - base);
+#ifdef MADV_HUGEPAGE
+		hugepage = !madvise(base, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+		if (populate) {
+			for (size_t i = 0; i < REGION_SIZE; i += 4096) {
+				base[i] = 0;
+			}
+		}
+	}
+
+	/* Fresh anonymous memory is zeroed */
+	r = (region *) base;
+	r->origin.kind = ORIGIN_REGION;
+	r->arena = a;
+	r->bump = base + REGION_HEADER;
+	r->hugetlb = hugetlb;
+	r->hugepage = hugepage;
+	r->next = a->regions;
+	a->regions = r;
+
+	return r;
+}
+
+uint64_t
+region_activity(region *r)
+{
+	uint64_t seen = (r->origin.live * 0x9e3779b97f4a7c15ull) ^
+			(size_t) r->bump;
+
+	for (unsigned c = 0; c < ARENA_CLASSES; c++) {
+		seen = (seen ^ (size_t) r->free[c]) * 0x100000001b3ull;
+	}
+
+	return seen;
+}
+
+size_t
+region_trim(region *r, size_t page)
+{
+	size_t released = 0;
+
+	for (unsigned c = 0; c < ARENA_CLASSES; c++) {
+		size_t bytes = arena_class_size(c);
+		if (bytes < 2 * page) {
+			continue;
+		}
+		for (char *block = (char *) r->free[c]; block;
+		     block = *(char **) block) {
+			size_t start = ((size_t) block + page) & ~(page - 1);
+			size_t end = ((size_t) block + bytes) & ~(page - 1);
+			if (start < end &&
+			    !madvise((void *) start, end - start,
+				     MADV_DONTNEED)) {
+				released += end - start;
+			}
+		}
+	}
+
+	return released;
+}
+
+void
+region_unmap(region **link)
+{
+	region *r = *link;
+	arena *a = r->arena;
+
+	for (unsigned c = 0; c < ARENA_CLASSES; c++) {
+		if (!r->free[c]) {
+			continue;
+		}
+		if (r->avail_prev[c]) {
+			r->avail_prev[c]->avail_next[c] = r->avail_next[c];
+		} else {
+			a->avail[c] = r->avail_next[c];
+		}
+		if (r->avail_next[c]) {
+			r->avail_next[c]->avail_prev[c] = r->avail_prev[c];
+		}
+	}
+	if (a->current == r) {
+		a->current = 0;
+	}
+	*link = r->next;
+	munmap(r, REGION_SIZE);
+}
+
+void *
+trim_main(void *arg)
+{
+	struct timespec due;
+
+	(void) arg;
+	pthread_mutex_lock(&trim.wake_lock);
+	while (!trim.stop) {
+		/* Pass four times per decay time */
+		clock_gettime(CLOCK_REALTIME, &due);
+		due.tv_nsec += (long) (trim.decay % 4000) * 250000;
+		due.tv_sec += trim.decay / 4000 + due.tv_nsec / 1000000000;
+		due.tv_nsec %= 1000000000;
+		if (!pthread_cond_timedwait(&trim.wake, &trim.wake_lock,
+					    &due) || trim.stop) {
+			continue;
+		}
+
+		/* Never wait for the heap lock while stop could wait */
+		pthread_mutex_unlock(&trim.wake_lock);
+		pthread_mutex_lock(trim.lock);
+		cclass_trim(trim.decay);
+		pthread_mutex_unlock(trim.lock);
+		pthread_mutex_lock(&trim.wake_lock);
+	}
+	pthread_mutex_unlock(&trim.wake_lock);
+
+	return 0;
+}
+
+bool
+persist_walk(persist_header *h, classdesc **classes, size_t n, bool attach)
+{
+	size_t regions = (h->size - PERSIST_HEADER) / REGION_SIZE;
+	unsigned id = (attach ? site_lookup("(persistent)", 0) : 0);
+	region **link = &h->arena.regions;
+
+	for (size_t i = 0; i < regions; i++) {
+		region *r = (region *) ((char *) h + PERSIST_HEADER +
+					i * REGION_SIZE);
+		char *end = (char *) r + REGION_SIZE;
+		char *q = (char *) r + REGION_HEADER;
+
+		if (r->origin.kind != ORIGIN_REGION || r->bump < q ||
+		    r->bump > end) {
+			return false;
+		}
+		if (attach) {
+			memset(r->free, 0, sizeof(r->free));
+			memset(r->avail_next, 0, sizeof(r->avail_next));
+			memset(r->avail_prev, 0, sizeof(r->avail_prev));
+			r->origin.live = 0;
+			r->arena = &h->arena;
+			r->hugetlb = r->hugepage = false;
+			r->next = 0;
+			*link = r;
+			link = &r->next;
+		}
+
+		/* Every block is either live, or free with its class */
+		while (q < r->bump) {
+			prefix *p = (prefix *) q;
+			size_t bytes;
+			if (q + sizeof(prefix) > r->bump) {
+				return false;
+			}
+			if (p->mem == p + 1) {
+				size_t size = ((char *) p->postfix -
+					       (char *) p->mem);
+				classdesc *class;
+				/* Postfix inside the carved part, then read */
+				if ((char *) p->postfix < (char *) p->mem ||
+				    (char *) p->postfix + sizeof(postfix) >
+				    r->bump ||
+				    BLOCKSIZE(size) > ARENA_MAX ||
+				    p->postfix->prefix != p ||
+				    p->origin != &r->origin) {
+					return false;
+				}
+				bytes = arena_class_size(
+				    arena_class(BLOCKSIZE(size)));
+				class = persist_bind(h, p->class, classes, n);
+				if (!class || q + bytes > r->bump) {
+					return false;
+				}
+				if (attach) {
+					p->class = class;
+					if (!class_reserve(class, 1) ||
+					    !registry_insert(p, size, 0, id)) {
+						return false;
+					}
+					class_insert(p);
+					r->origin.live++;
+					h->arena.used += bytes;
+					METRICS(class, id, 1, size);
+					__atomic_add_fetch(&budget.bytes,
+							   BLOCKSIZE(size),
+							   __ATOMIC_RELAXED);
+					__atomic_add_fetch(&class->bytes,
+							   BLOCKSIZE(size),
+							   __ATOMIC_RELAXED);
+				}
+			} else {
+				size_t c = ((size_t *) q)[1];
+				if (!c || c > ARENA_CLASSES) {
+					return false;
+				}
+				bytes = arena_class_size(c - 1);
+				if (q + bytes > r->bump) {
+					return false;
+				}
+				if (attach) {
+					((void **) q)[0] = r->free[c - 1];
+					r->free[c - 1] = q;
+				}
+			}
+			q += bytes;
+		}
+
+		/* Link region on the avail lists of its free blocks */
+		for (unsigned c = 0; attach && c < ARENA_CLASSES; c++) {
+			if (r->free[c]) {
+				r->avail_next[c] = h->arena.avail[c];
+				if (h->arena.avail[c]) {
+					h->arena.avail[c]->avail_prev[c] = r;
+				}
+				h->arena.avail[c] = r;
+			}
+		}
+	}
+
+	return true;
+}
+
+classdesc *
+persist_bind(persist_header *h, classdesc *class, classdesc **classes,
+	     size_t n)
+{
+	const char *name = 0;
+
+	for (size_t i = 0; i < h->classes && !name; i++) {
+		if (h->class[i].desc == class) {
+			name = h->class[i].name;
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (classes[i] == class ||
+		    (name && !strncmp(classes[i]->name, name, PERSIST_NAME))) {
+			return classes[i];
+		}
+	}
+
+	return 0;
+}
+
+void
+persist_detach(persist_header *h)
+{
+	/* Backwards, as removal moves the last entry into the slot */
+	for (size_t index = registry.count; index--;) {
+		prefix *p = CHUNK(index)->block[SLOT(index)];
+		if (p->origin && p->origin->kind == ORIGIN_REGION &&
+		    ((region *) p->origin)->arena == &h->arena) {
+			unsigned id = CHUNK(index)->site[SLOT(index)];
+			size_t size = CHUNK(index)->size[SLOT(index)];
+			METRICS(p->class, id, -1, -(long) size);
+			budget_uncharge(p->class, BLOCKSIZE(size));
+			family_drop(p);
+			handle_release(p);
+			class_remove(p);
+			registry_remove(p);
+		}
+	}
+}
+
+void
+persist_lock(persist_header *h)
+{
+	arena *a = &h->arena;
+
+	if (pthread_mutex_lock(&h->lock) != EOWNERDEAD) {
+		return;
+	}
+	memset(a->avail, 0, sizeof(a->avail));
+	for (region *r = a->regions; r; r = r->next) {
+		for (unsigned c = 0; c < ARENA_CLASSES; c++) {
+			r->avail_prev[c] = 0;
+			r->avail_next[c] = (r->free[c] ? a->avail[c] : 0);
+			if (r->free[c] && a->avail[c]) {
+				a->avail[c]->avail_prev[c] = r;
+			}
+			if (r->free[c]) {
+				a->avail[c] = r;
+			}
+		}
+	}
+	pthread_mutex_consistent(&h->lock);
+}
+
+bool
+persist_map(int fd, bool create, bool shared, void *base, size_t size,
+	    classdesc **classes, size_t n)
+{
+	persist_header *h;
+	struct stat st;
+
+	/* A new file gets whole regions, an old one keeps its size */
+	if (fstat(fd, &st) || (!st.st_size &&
+			       (!create ||
+				size < PERSIST_HEADER + REGION_SIZE ||
+				ftruncate(fd, PERSIST_HEADER +
+					  (size - PERSIST_HEADER) /
+					  REGION_SIZE * REGION_SIZE) ||
+				fstat(fd, &st)))) {
+		close(fd);
+		return false;
+	}
+	size = st.st_size;
+	h = (persist_header *) mmap(base, size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		return false;
+	}
+	if (h != base) {
+		munmap(h, size);
+		return false;
+	}
+
+	/* Lay out a new heap; the file reads as zeroes */
+	if (create && !h->magic) {
+		size_t regions = (size - PERSIST_HEADER) / REGION_SIZE;
+		h->version = PERSIST_VERSION;
+		h->base = base;
+		h->size = size;
+		h->shared = shared;
+		if (shared) {
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr,
+						     PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr,
+						    PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&h->lock, &attr);
+			pthread_mutexattr_destroy(&attr);
+		}
+		h->arena.fixed = true;
+		for (size_t i = regions; i--;) {
+			region *r = (region *) ((char *) h + PERSIST_HEADER +
+						i * REGION_SIZE);
+			r->origin.kind = ORIGIN_REGION;
+			r->bump = (char *) r + REGION_HEADER;
+			r->arena = &h->arena;
+			r->next = h->arena.regions;
+			h->arena.regions = r;
+		}
+		h->classes = n;
+		for (size_t i = 0; i < n; i++) {
+			h->class[i].desc = classes[i];
+			strncpy(h->class[i].name, classes[i]->name,
+				PERSIST_NAME);
+		}
+		__atomic_store_n(&h->magic, PERSIST_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	/* Check all of it before changing anything */
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != PERSIST_MAGIC ||
+	    h->version != PERSIST_VERSION || h->base != base ||
+	    h->size != size || h->shared != shared ||
+	    h->classes > PERSIST_CLASSES) {
+		munmap(h, size);
+		return false;
+	}
+	if (shared) {
+		/* Descriptors must be the ones the segment refers to */
+		bool same = (h->classes == n);
+		for (size_t i = 0; same && i < n; i++) {
+			same = (h->class[i].desc == classes[i]);
+		}
+		if (!same) {
+			munmap(h, size);
+			return false;
+		}
+	} else if (!persist_walk(h, classes, n, false)) {
+		munmap(h, size);
+		return false;
+	} else {
+		memset(&h->arena, 0, sizeof(h->arena));
+		h->arena.fixed = true;
+		if (!persist_walk(h, classes, n, true)) {
+			persist_detach(h);
+			munmap(h, size);
+			return false;
+		}
+
+		/* Record the descriptors the objects now refer to */
+		h->classes = n;
+		for (size_t i = 0; i < n; i++) {
+			h->class[i].desc = classes[i];
+			strncpy(h->class[i].name, classes[i]->name,
+				PERSIST_NAME);
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		classes[i]->flags |= CCLASS_PERSISTENT;
+	}
+	persist = h;
+
+	return true;
+}
+
+void
+metrics_count(classdesc *class, unsigned id, long n, long bytes)
+{
+	cclass_counters *counters[3];
+	unsigned slot = 0;
+
+	/* Assign class slot on first use in this publication */
+	if (class) {
+		if (class->metrics >> METRICS_SLOT_BITS == metrics_epoch) {
+			slot = class->metrics & ((1 << METRICS_SLOT_BITS) - 1);
+		} else {
+			slot = __atomic_fetch_add(&metrics->classes, 1,
+						  __ATOMIC_RELAXED);
+			if (slot < CCLASS_METRICS_CLASSES - 1) {
+				strncpy(metrics->class[slot].name, class->name,
+					CCLASS_METRICS_NAME - 1);
+			} else {
+				slot = CCLASS_METRICS_CLASSES - 1;
+				metrics->classes = CCLASS_METRICS_CLASSES;
+			}
+			class->metrics = metrics_epoch << METRICS_SLOT_BITS |
+					 slot;
+		}
+	}
+
+	counters[0] = &metrics->total;
+	counters[1] = &metrics->class[slot].counters;
+	counters[2] = &metrics->site[id < CCLASS_METRICS_SITES - 1 ?
+				     id : CCLASS_METRICS_SITES - 1].counters;
+	for (int i = 0; i < 3; i++) {
+		if (n > 0) {
+			__atomic_add_fetch(&counters[i]->allocs, n,
+					   __ATOMIC_RELAXED);
+		} else if (n < 0) {
+			__atomic_add_fetch(&counters[i]->frees, -n,
+					   __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&counters[i]->blocks, n, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counters[i]->bytes, bytes,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+void
+metrics_site(unsigned id)
+{
+	if (id < CCLASS_METRICS_SITES - 1) {
+		const char *file = sites.site[id].file;
+		const char *base = strrchr(file, '/');
+		strncpy(metrics->site[id].file, (base ? base + 1 : file),
+			CCLASS_METRICS_NAME - 1);
+		metrics->site[id].line = sites.site[id].line;
+		metrics->sites = id + 1;
+	}
+}
+
+void
+trace_event(cclass_trace_op op, classdesc *class, unsigned id, void *mem,
+	    void *old, size_t size)
+{
+	trace_buffer *b;
+	cclass_trace_event *e;
+	struct timespec now;
+
+	if (class && class->trace != trace.epoch) {
+		class->trace = trace.epoch;
+		trace_name(CCLASS_TRACE_CLASS, (uintptr_t) class, class->flags,
+			   class->name);
+	}
+	b = trace_room(1);
+	if (b) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		e = &b->event[b->count++];
+		e->time = (uint64_t) (now.tv_sec - trace.start.tv_sec) *
+			  1000000000 + now.tv_nsec - trace.start.tv_nsec;
+		e->block = (uintptr_t) mem;
+		e->old = (uintptr_t) old;
+		e->size = size;
+		e->class = (uintptr_t) class;
+		e->thread = b->thread;
+		e->site = id;
+		e->op = op;
+		e->reserved = 0;
+	}
+}
+
+void
+trace_name(cclass_trace_op op, uint64_t id, uint64_t size,
+	   const char *name)
+{
+	size_t length = strlen(name);
+	size_t n = 1 + (length + sizeof(cclass_trace_event)) /
+		   sizeof(cclass_trace_event);
+	trace_buffer *b = trace_room(n);
+
+	if (b) {
+		cclass_trace_event *e = &b->event[b->count];
+		memset(e, 0, n * sizeof(cclass_trace_event));
+		e->block = length;
+		e->size = size;
+		e->class = (op == CCLASS_TRACE_CLASS ? id : 0);
+		e->thread = b->thread;
+		e->site = (op == CCLASS_TRACE_SITE ? id : 0);
+		e->op = op;
+		memcpy(e + 1, name, length);
+		b->count += n;
+	}
+}
+
+trace_buffer *
+trace_room(size_t n)
+{
+	trace_buffer *b = trace_local;
+
+	if (n > TRACE_EVENTS) {
+		return 0;
+	}
+
+	/* Map buffer of thread on first use */
+	if (!b) {
+		b = mmap(0, sizeof(trace_buffer), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b == MAP_FAILED) {
+			return 0;
+		}
+		b->thread = (uint32_t) syscall(SYS_gettid);
+		b->next = __atomic_load_n(&trace.buffers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&trace.buffers, &b->next,
+						    b, true, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) {
+			/* retry with updated next */
+		}
+		trace_local = b;
+	}
+
+	if (b->count + n > TRACE_EVENTS) {
+		trace_flush(b);
+	}
+
+	return b;
+}
+
+void
+trace_flush(trace_buffer *b)
+{
+	const char *data = (const char *) b->event;
+	size_t left = b->count * sizeof(cclass_trace_event);
+
+	while (left) {
+		ssize_t written = write(trace.fd, data, left);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		XASSERT(written > 0) {
+			data += written;
+			left -= written;
+			continue;
+		}
+		break;
+	}
+	b->count = 0;
+}
+
+uint64_t
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void
+latency_count(classdesc *class, unsigned id, cclass_latency_op op,
+	      uint64_t t, uint64_t n)
+{
+	struct cclass_histograms_tag *hs[3] = { &latency.all, 0, 0 };
+	size_t index = t;
+
+	/* Bucket of t */
+	if (t >= LATENCY_SUB) {
+		unsigned e = 63 - __builtin_clzll(t);
+		if (e > LATENCY_EXP_MAX) {
+			index = LATENCY_BUCKETS - 1;
+		} else {
+			index = (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+				((t >> (e - LATENCY_SUB_BITS)) &
+				 (LATENCY_SUB - 1));
+		}
+	}
+
+	if (class) {
+		hs[1] = latency_histograms(&class->latency, class, 0);
+	}
+	if (id && id < sites.count) {
+		hs[2] = latency_histograms(&sites.site[id].latency, 0, id);
+	}
+	for (int i = 0; i < 3; i++) {
+		if (hs[i]) {
+			histogram *h = &hs[i]->op[op];
+			h->bucket[index] += n;
+			h->count += n;
+			h->max = (t > h->max ? t : h->max);
+		}
+	}
+}
+
+struct cclass_histograms_tag *
+latency_histograms(struct cclass_histograms_tag **slot, classdesc *class,
+		   unsigned id)
+{
+	if (!*slot) {
+		*slot = (struct cclass_histograms_tag *)
+		    calloc(1, sizeof(struct cclass_histograms_tag));
+		if (*slot) {
+			(*slot)->class = class;
+			(*slot)->site = id;
+			(*slot)->next = latency.list;
+			latency.list = *slot;
+		}
+	}
+
+	return *slot;
+}
+
+uint64_t
+bucket_bound(size_t index)
+{
+	unsigned e = index / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+
+	if (index < LATENCY_SUB) {
+		return index;
+	}
+	return ((uint64_t) (LATENCY_SUB + index % LATENCY_SUB + 1) <<
+		(e - LATENCY_SUB_BITS)) - 1;
+}
+
+bool
+latency_read(const histogram *h, cclass_latency_info *info)
+{
+	const double q[3] = { 0.5, 0.99, 0.999 };
+	unsigned long *p[3] = { &info->p50, &info->p99, &info->p999 };
+	uint64_t seen = 0;
+	size_t index = 0;
+
+	memset(info, 0, sizeof(*info));
+	if (!h || !h->count) {
+		return false;
+	}
+
+	/* Walk buckets up to each percentile in turn */
+	for (int i = 0; i < 3; i++) {
+		uint64_t rank = (uint64_t) (q[i] * h->count + 0.999999);
+		while (seen + h->bucket[index] < rank) {
+			seen += h->bucket[index++];
+		}
+		*p[i] = (bucket_bound(index) < h->max ?
+			 bucket_bound(index) : h->max) * latency.ns_per_tick;
+	}
+	info->count = h->count;
+	info->max = h->max * latency.ns_per_tick;
+
+	return true;
+}
+
+size_t
+intern_slot(const char *s, size_t hash)
+{
+	size_t h = hash & (intern.size - 1);
+
+	while (intern.table[h] && (INTERNED(intern.table[h])->hash != hash ||
+				   strcmp(intern.table[h], s))) {
+		h = (h + 1) & (intern.size - 1);
+	}
+
+	return h;
+}
+
+void
+overhead_add(cclass_overhead *o, chunk *c, size_t slot)
+{
+	prefix *p = c->block[slot];
+	size_t block = BLOCKSIZE(c->size[slot]);
+	size_t held = block;
+
+	if (!p->origin) {
+		held = (backend->usable_size ? backend->usable_size(p) : 0);
+	} else if (p->origin->kind == ORIGIN_REGION) {
+		held = arena_class_size(arena_class(block));
+	} else {
+		held = SLAB_ALIGN(block);
+	}
+
+	o->blocks++;
+	o->payload += c->size[slot] - c->pad[slot];
+	o->rounding += c->pad[slot];
+	o->headers += sizeof(prefix) + sizeof(postfix);
+	o->slack += (held > block ? held - block : 0);
+	o->registry += sizeof(prefix *) + sizeof(size_t) + sizeof(unsigned) +
+		       sizeof(classdesc *) + sizeof(unsigned char) +
+		       sizeof(family *) +
+		       (c->family[slot] ? sizeof(family) : 0) +
+		       sizeof(unsigned) +
+		       (c->handle[slot] ? sizeof(handle_entry) : 0) +
+		       sizeof(unsigned) +
+		       (c->class[slot] ? sizeof(void *) : 0);
+}
+
+void
+overhead_ratio(cclass_overhead *o)
+{
+	size_t total = o->payload + o->rounding + o->headers + o->slack +
+		       o->registry + o->arena_free;
+
+	o->fragmentation = (total ? 1 - (double) o->payload / total : 0);
+}
+
+bool
+budget_charge(classdesc *class, size_t bytes, budget_signal *defer)
+{
+	bool critical = (class && (class->flags & CCLASS_CRITICAL));
+	budget_signal now = { false, false, 0, 0 };
+	budget_signal *s = (defer ? defer : &now);
+
+	for (int attempt = 0;; attempt++) {
+		size_t total = __atomic_add_fetch(&budget.bytes, bytes,
+						  __ATOMIC_RELAXED);
+		size_t own = (class ? __atomic_add_fetch(&class->bytes, bytes,
+							 __ATOMIC_RELAXED) : 0);
+		bool over_total = (budget.budget && total > budget.budget);
+		bool over_own = (class && class->budget &&
+				 own > class->budget);
+
+		if (critical || (!over_total && !over_own)) {
+			/* Signal soft limits when crossed */
+			s->global = (budget.pressure && budget.soft_limit &&
+				     total >= budget.soft_limit &&
+				     total - bytes < budget.soft_limit);
+			s->own = (class && class->pressure &&
+				  class->soft_limit &&
+				  own >= class->soft_limit &&
+				  own - bytes < class->soft_limit);
+			s->total = total;
+			s->bytes = own;
+			if (!defer) {
+				budget_signal_call(class, s);
+			}
+			return true;
+		}
+
+		/* Let caches shed load, then try once more */
+		budget_uncharge(class, bytes);
+		s->global = (over_total && budget.pressure);
+		s->own = (over_own && class->pressure);
+		s->total = total - bytes;
+		s->bytes = own - bytes;
+		if (attempt || defer) {
+			return false;
+		}
+		budget_signal_call(class, s);
+	}
+}
+
+void
+budget_signal_call(classdesc *class, budget_signal *s)
+{
+	if (s->global) {
+		budget.pressure(0, s->total);
+	}
+	if (s->own) {
+		class->pressure(class, s->bytes);
+	}
+	s->global = s->own = false;
+}
+
+void
+budget_uncharge(classdesc *class, size_t bytes)
+{
+	__atomic_sub_fetch(&budget.bytes, bytes, __ATOMIC_RELAXED);
+	if (class) {
+		__atomic_sub_fetch(&class->bytes, bytes, __ATOMIC_RELAXED);
+	}
+}
+
+bool
+class_reserve(classdesc *class, size_t n)
+{
+	if (class && n > UINT_MAX - class->count) {
+		/* Slot would not fit prefix */
+		return false;
+	}
+	if (class && class->count + n > class->capacity) {
+		size_t capacity = (class->capacity ? 2 * class->capacity : 16);
+		void **objects;
+		if (capacity < class->count + n) {
+			capacity = class->count + n;
+		}
+		objects = (void **) realloc(class->objects,
+					    capacity * sizeof(void *));
+		if (!objects) {
+			return false;
+		}
+		class->objects = objects;
+		class->capacity = capacity;
+	}
+
+	return true;
+}
+
+void
+class_insert(prefix *p)
+{
+	classdesc *class = p->class;
+
+	if (class) {
+		p->class_index = class->count++;
+		class->objects[p->class_index] = p->mem;
+		if (class->count > class->peak) {
+			class->peak = class->count;
+		}
+		if (class->bytes > class->peak_bytes) {
+			class->peak_bytes = class->bytes;
+		}
+	}
+}
+
+void
+class_remove(prefix *p)
+{
+	classdesc *class = p->class;
+
+	if (class) {
+		size_t last = --class->count;
+		if (p->class_index != last) {
+			void *mem = class->objects[last];
+			class->objects[p->class_index] = mem;
+			((prefix *) mem - 1)->class_index = p->class_index;
+		}
+	}
+}
+
+bool
+list_verify(void *mem)
+{
+	bool ok = false;
+
+	if (mem) {
+		XASSERT(cclass_test_pointer(mem)) {
+			prefix *p = (prefix *) mem - 1;
+			XASSERT(p->mem == mem) {
+				XASSERT(p->postfix->prefix == p) {
+					XASSERT(p->index < registry.count &&
+						CHUNK(p->index)->
+						block[SLOT(p->index)] == p) {
+						ok = true;
+					}
+				}
+			}
+		}
+		if (!ok) {
+			CCLASS_PROBE1(verify_fail, mem);
+		}
+	}
+
+	return (ok);
+}
+
+void
+render(prefix *p, char *buffer)
+{
+	if (p->mem == &p[1]) {
+		site *s = &sites.site[CHUNK(p->index)->site[SLOT(p->index)]];
+		sprintf(buffer, "%8p ", p);
+		if (s->file) {
+			sprintf(buffer + strlen(buffer), "%12s %4ld ",
+				s->file, s->line);
+		}
+		if (p->class) {
+			sprintf(buffer + strlen(buffer), "%s",
+				p->class->name);
+		}
+		if (CHUNK(p->index)->family[SLOT(p->index)] &&
+		    CHUNK(p->index)->family[SLOT(p->index)]->parent) {
+			sprintf(buffer + strlen(buffer), " <%p",
+				CHUNK(p->index)->family[SLOT(p->index)]->
+				parent->self->mem);
+		}
+		if (CHUNK(p->index)->stack[SLOT(p->index)]) {
+			sprintf(buffer + strlen(buffer), " #%u",
+				CHUNK(p->index)->stack[SLOT(p->index)]);
+		}
+	} else {
+		strcpy(buffer, "(bad)");
+	}
+}
+
+bool
+site_grow(void)
+{
+	size_t hashsize = sites.hashsize ? 2 * sites.hashsize : 256;
+	unsigned *hash = (unsigned *) calloc(hashsize, sizeof(unsigned));
+	site *table = (site *) realloc(sites.site,
+				       hashsize / 2 * sizeof(site));
+	if (!hash || !table) {
+		free(hash);
+		if (table) {
+			sites.site = table;
+		}
+		return false;
+	}
+	sites.site = table;
+	if (!sites.count) {
+		sites.site[0].file = 0;
+		sites.site[0].line = 0;
+		sites.site[0].latency = 0;
+		sites.count = 1;
+	}
+	for (unsigned id = 1; id < sites.count; id++) {
+		site *s = &sites.site[id];
+		size_t h = SITE_HASH(s->file, s->line) & (hashsize - 1);
+		while (hash[h]) {
+			h = (h + 1) & (hashsize - 1);
+		}
+		hash[h] = id + 1;
+	}
+	free(sites.hash);
+	sites.hash = hash;
+	sites.hashsize = hashsize;
+
+	return true;
+}
+
+unsigned
+site_lookup(const char *file, long line)
+{
+	size_t h;
+
+	/* Grow hash and site table at half load */
+	if (!file || (2 * sites.count >= sites.hashsize && !site_grow())) {
+		return 0;
+	}
+
+	/* Probe for site, adding it when not found */
+	h = SITE_HASH(file, line) & (sites.hashsize - 1);
+	while (sites.hash[h]) {
+		site *s = &sites.site[sites.hash[h] - 1];
+		if (s->file == file && s->line == line) {
+			return sites.hash[h] - 1;
+		}
+		h = (h + 1) & (sites.hashsize - 1);
+	}
+	sites.site[sites.count].file = file;
+	sites.site[sites.count].line = line;
+	sites.site[sites.count].latency = 0;
+	sites.hash[h] = sites.count + 1;
+	if (metrics) {
+		metrics_site(sites.count);
+	}
+	if (trace.fd >= 0) {
+		trace_name(CCLASS_TRACE_SITE, sites.count, line, file);
+	}
+
+	return sites.count++;
+}
+
+unsigned
+stack_capture(void)
+{
+	void *frame[STACK_DEPTH + STACK_SKIP];
+	int n;
+	int skip = 1;
+
+	stacks.countdown = stacks.period;
+	n = backtrace(frame, stacks.depth + STACK_SKIP);
+
+	/* Drop the frames of the library itself */
+	while (skip < n &&
+	       (size_t) frame[skip] - stacks.text < stacks.text_size) {
+		skip++;
+	}
+	if (n - skip > (int) stacks.depth) {
+		n = skip + stacks.depth;
+	}
+
+	return (n > skip ? stack_lookup(frame + skip, n - skip) : 0);
+}
+
+int
+stack_text(struct dl_phdr_info *info,
+	   size_t size,
+	   void *data)
+{
+	size_t code = (size_t) stack_capture;
+
+	(void) size;
+	(void) data;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		size_t start = info->dlpi_addr + ph->p_vaddr;
+		if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X) &&
+		    code - start < ph->p_memsz) {
+			if (info->dlpi_name && *info->dlpi_name) {
+				stacks.text = start;
+				stacks.text_size = ph->p_memsz;
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+unsigned
+stack_lookup(void **frame, unsigned depth)
+{
+	unsigned hash = 2166136261u;
+	size_t h;
+
+	for (unsigned i = 0; i < depth; i++) {
+		hash = (hash ^ (unsigned) ((size_t) frame[i] >> 2)) *
+		       16777619u;
+	}
+
+	/* Grow hash and stack table at half load */
+	if (2 * stacks.count >= stacks.hashsize) {
+		size_t hashsize = stacks.hashsize ? 2 * stacks.hashsize : 256;
+		unsigned *table_hash = (unsigned *) calloc(hashsize,
+							   sizeof(unsigned));
+		stack *table = (stack *) realloc(stacks.stack, hashsize / 2 *
+						 sizeof(stack));
+		if (!table_hash || !table) {
+			free(table_hash);
+			if (table) {
+				stacks.stack = table;
+			}
+			return 0;
+		}
+		stacks.stack = table;
+		if (!stacks.count) {
+			memset(&stacks.stack[0], 0, sizeof(stack));
+			stacks.count = 1;
+		}
+		for (unsigned id = 1; id < stacks.count; id++) {
+			h = stacks.stack[id].hash & (hashsize - 1);
+			while (table_hash[h]) {
+				h = (h + 1) & (hashsize - 1);
+			}
+			table_hash[h] = id + 1;
+		}
+		free(stacks.hash);
+		stacks.hash = table_hash;
+		stacks.hashsize = hashsize;
+	}
+
+	/* Probe for stack, adding it when not found */
+	h = hash & (stacks.hashsize - 1);
+	while (stacks.hash[h]) {
+		stack *k = &stacks.stack[stacks.hash[h] - 1];
+		if (k->hash == hash && k->depth == depth &&
+		    !memcmp(&stacks.frame[k->frame], frame,
+			    depth * sizeof(void *))) {
+			return stacks.hash[h] - 1;
+		}
+		h = (h + 1) & (stacks.hashsize - 1);
+	}
+	if (stacks.frames + depth > stacks.frame_size) {
+		size_t size = (stacks.frame_size ? 2 * stacks.frame_size :
+			       1024);
+		void **pool = (void **) realloc(stacks.frame,
+						size * sizeof(void *));
+		if (!pool) {
+			return 0;
+		}
+		stacks.frame = pool;
+		stacks.frame_size = size;
+	}
+	memcpy(&stacks.frame[stacks.frames], frame, depth * sizeof(void *));
+	stacks.stack[stacks.count].frame = stacks.frames;
+	stacks.stack[stacks.count].depth = depth;
+	stacks.stack[stacks.count].hash = hash;
+	stacks.frames += depth;
+	stacks.hash[h] = stacks.count + 1;
+
+	return stacks.count++;
+}
+
+void
+object_free(prefix *p)
+{
+	void *mem = p->mem;
+	classdesc *class = p->class;
+	chunk *c = CHUNK(p->index);
+	unsigned id = c->site[SLOT(p->index)];
+	size_t size = c->size[SLOT(p->index)];
+
+	METRICS(class, id, -1, -(long) size);
+	TRACE(CCLASS_TRACE_FREE, class, id, mem, 0, size);
+	budget_uncharge(class, BLOCKSIZE(size));
+	family_drop(p);
+	handle_release(p);
+	class_remove(p);
+	registry_remove(p);
+	block_free(p, size);
+	CCLASS_PROBE5(free_return, mem, size, CCLASS_PROBE_CLASS(class),
+		      sites.site[id].file, sites.site[id].line);
+}
+
+bool
+object_unshare(prefix *p)
+{
+	unsigned refs = __atomic_load_n(&p->refs, __ATOMIC_RELAXED);
+
+	while (refs > 1 &&
+	       !__atomic_compare_exchange_n(&p->refs, &refs, refs - 1, true,
+					    __ATOMIC_ACQ_REL,
+					    __ATOMIC_RELAXED)) {
+		/* retry */
+	}
+
+	return (refs > 1);
+}
+
+void
+family_drop(prefix *p)
+{
+	family *f = CHUNK(p->index)->family[SLOT(p->index)];
+
+	if (f) {
+		/* Unlink from owner */
+		if (f->prev) {
+			f->prev->next = f->next;
+		} else if (f->parent) {
+			f->parent->child = f->next;
+		}
+		if (f->next) {
+			f->next->prev = f->prev;
+		}
+		for (family *c = f->child; c; c = c->next) {
+			c->parent = 0;
+		}
+		CHUNK(p->index)->family[SLOT(p->index)] = 0;
+		free(f);
+	}
+}
+
+void
+handle_release(prefix *p)
+{
+	unsigned slot = CHUNK(p->index)->handle[SLOT(p->index)];
+
+	if (slot--) {
+		handle_entry *e = &handles.entry[slot];
+		e->mem = 0;
+		e->class = 0;
+		e->generation = (e->generation + 1 ? e->generation + 1 : 1);
+		e->next = handles.free;
+		handles.free = slot + 1;
+		CHUNK(p->index)->handle[SLOT(p->index)] = 0;
+	}
+}
+
+family *
+family_get(prefix *p, bool create)
+{
+	family **f = &CHUNK(p->index)->family[SLOT(p->index)];
+
+	if (!*f && create) {
+		*f = (family *) calloc(1, sizeof(family));
+		if (*f) {
+			(*f)->self = p;
+		}
+	}
+
+	return *f;
+}
+
+void *
+cclass_free(void *mem)
+{
+	LATENCY_START(start);
+
+	CCLASS_PROBE1(free_entry, mem);
+	if (list_verify(mem) && !object_unshare((prefix *) mem - 1)) {
+		prefix *p = (prefix *) mem - 1;
+		classdesc *class = p->class;
+		unsigned id = CHUNK(p->index)->site[SLOT(p->index)];
+		family *root;
+		family *f;
+		if (class && class->fini) {
+			class->fini(mem);
+		}
+
+		/*
+		 * Release owned objects depth first, without recursion.
+		 * Descending into an object calls its fini hook, which
+		 * may itself free owned objects; an object is released
+		 * on the way up, once it owns nothing.  An owned object
+		 * retained elsewhere loses the owner's reference and is
+		 * detached instead, keeping what it owns itself.
+		 */
+		root = family_get(p, false);
+		f = root;
+		while (f && f->child) {
+			family *parent;
+			f = f->child;
+			if (object_unshare(f->self)) {
+				parent = f->parent;
+				parent->child = f->next;
+				if (f->next) {
+					f->next->prev = 0;
+				}
+				f->parent = f->next = 0;
+				f = parent;
+			} else if (f->self->class && f->self->class->fini) {
+				f->self->class->fini(f->self->mem);
+			}
+			while (!f->child && f != root) {
+				parent = f->parent;
+				object_free(f->self);
+				f = parent;
+			}
+		}
+
+		object_free(p);
+		LATENCY(class, id, CCLASS_LATENCY_FREE, start);
+	}
+
+	return 0;
+}
+
+bool
+cclass_class_reserve(classdesc *class,
+		     size_t n,
+		     size_t size)
+{
+	bool ok = (class_reserve(class, n) && registry_reserve(n));
+
+	/* Only arena memory can be laid out ahead of allocation */
+	if (ok && !(class && (class->flags & CCLASS_PERSISTENT)) &&
+	    arena_selects(class, DOALIGN(size))) {
+		ok = (arena_reserve(&huge_arena, BLOCKSIZE(DOALIGN(size)), n)
+		      == n);
+	}
+
+	return ok;
+}
+
+size_t
+cclass_class_foreach(classdesc *class,
+		     void (*func)(void *obj, void *arg),
+		     void *arg)
+{
+	size_t visited = 0;
+	size_t i = class->count;
+
+	/* Backwards, so that func may free the current object */
+	while (i--) {
+		func(class->objects[i], arg);
+		visited++;
+		if (i > class->count) {
+			i = class->count;
+		}
+	}
+
+	return visited;
+}
+
+void
+cclass_free_batch(void **mem,
+		  size_t n)
+{
+	size_t count = 0;
+	LATENCY_START(start);
+
+	CCLASS_PROBE2(free_batch_entry, mem, n);
+
+	/* Objects with hooks, owned or shared objects go one by one */
+	for (size_t i = 0; i < n; i++) {
+		prefix *p = (prefix *) mem[i] - 1;
+		if (!list_verify(mem[i])) {
+			mem[i] = 0;
+		} else if ((p->class && p->class->fini) ||
+			   family_get(p, false) ||
+			   __atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) > 1) {
+			mem[i] = cclass_free(mem[i]);
+		}
+	}
+
+	/*
+	 * The rest has no hooks that could free them meanwhile.  Clear
+	 * mem in each prefix, so that an object given twice fails to
+	 * verify the second time, and collect the prefixes in mem.
+	 */
+	for (size_t i = 0; i < n; i++) {
+		if (list_verify(mem[i])) {
+			prefix *p = (prefix *) mem[i] - 1;
+			chunk *c = CHUNK(p->index);
+			unsigned id = c->site[SLOT(p->index)];
+			size_t size = c->size[SLOT(p->index)];
+			METRICS(p->class, id, -1, -(long) size);
+			TRACE(CCLASS_TRACE_FREE, p->class, id, p->mem, 0, size);
+			budget_uncharge(p->class, BLOCKSIZE(size));
+			family_drop(p);
+			handle_release(p);
+			class_remove(p);
+			registry_remove(p);
+			p->mem = 0;
+			mem[count++] = p;
+		}
+	}
+
+	/* Release memory once per slab and persistent heap lock */
+	qsort(mem, count, sizeof(*mem), block_order);
+	for (size_t i = 0, j; i < count; i = j) {
+		origin *o = ((prefix *) mem[i])->origin;
+		for (j = i + 1; j < count && ((prefix *) mem[j])->origin == o;
+		     j++) {
+			/* empty */
+		}
+		block_free_run(&mem[i], j - i);
+	}
+	memset(mem, 0, n * sizeof(*mem));
+
+	if (count) {
+		LATENCY_BATCH(0, 0, CCLASS_LATENCY_FREE, start, count);
+	}
+	CCLASS_PROBE2(free_batch_return, mem, count);
+}
+
+void
+cclass_arena_stats(cclass_arena_info *info)
+{
+	FILE *smaps;
+
+	memset(info, 0, sizeof(*info));
+	for (region *r = huge_arena.regions; r; r = r->next) {
+		info->regions++;
+		info->mapped += REGION_SIZE;
+		info->hugetlb += (r->hugetlb ? REGION_SIZE : 0);
+		info->hugepage += (r->hugepage ? REGION_SIZE : 0);
+	}
+	info->used = huge_arena.used;
+
+	/* Transparent huge pages actually backing the regions */
+	smaps = (huge_arena.regions ? fopen("/proc/self/smaps", "r") : 0);
+	if (smaps) {
+		char line[256];
+		bool ours = false;
+		while (fgets(line, sizeof(line), smaps)) {
+			unsigned long start, end, kb;
+			if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+				region *r = huge_arena.regions;
+				while (r && ((unsigned long) r >= end ||
+					     (unsigned long) r + REGION_SIZE <=
+					     start)) {
+					r = r->next;
+				}
+				ours = (r != 0);
+			} else if (ours &&
+				   sscanf(line, "AnonHugePages: %lu kB",
+					  &kb) == 1) {
+				info->backed += (size_t) kb << 10;
+			}
+		}
+		fclose(smaps);
+	}
+	info->backed += info->hugetlb;
+}
+
+size_t
+cclass_backtrace(void *mem,
+		 void **frame,
+		 size_t n)
+{
+	size_t depth = 0;
+
+	if (list_verify(mem)) {
+		prefix *p = (prefix *) mem - 1;
+		stack *k = &stacks.stack[CHUNK(p->index)->stack[SLOT(p->index)]];
+		if (k != stacks.stack) {
+			depth = (k->depth < n ? k->depth : n);
+			memcpy(frame, &stacks.frame[k->frame],
+			       depth * sizeof(void *));
+		}
+	}
+
+	return depth;
+}
+
+void *
+cclass_handle_object(cclass_handle handle,
+		     classdesc *desc)
+{
+	size_t slot = (unsigned) handle;
+	handle_entry *e;
+
+	if (slot >= handles.count) {
+		return 0;
+	}
+	e = &handles.entry[slot];
+
+	return (e->generation == handle >> 32 && e->mem &&
+		(!desc || e->class == desc) ? e->mem : 0);
+}
+
+cclass_handle
+cclass_handle_of(void *mem)
+{
+	prefix *p = (prefix *) mem - 1;
+	unsigned *slot;
+	handle_entry *e;
+
+	if (!list_verify(mem)) {
+		return 0;
+	}
+	slot = &CHUNK(p->index)->handle[SLOT(p->index)];
+	if (!*slot) {
+		/* Reuse a free slot, or grow the table */
+		if (handles.free) {
+			*slot = handles.free;
+			handles.free = handles.entry[*slot - 1].next;
+		} else if (handles.count < (unsigned) -1) {
+			if (handles.count == handles.size) {
+				size_t size = (handles.size ?
+					       2 * handles.size : 1024);
+				handle_entry *entry = (handle_entry *)
+				    realloc(handles.entry,
+					    size * sizeof(handle_entry));
+				if (!entry) {
+					asserterror();
+					return 0;
+				}
+				handles.entry = entry;
+				handles.size = size;
+			}
+			*slot = ++handles.count;
+			handles.entry[*slot - 1].generation = 1;
+		} else {
+			asserterror();
+			return 0;
+		}
+		e = &handles.entry[*slot - 1];
+		e->mem = mem;
+		e->class = p->class;
+		e->next = 0;
+	}
+	e = &handles.entry[*slot - 1];
+
+	return ((cclass_handle) e->generation << 32 | (*slot - 1));
+}
+
+void
+cclass_heap_stats(cclass_stats *stats)
+{
+	size_t bytes = 0;
+
+	for (size_t c = 0; c * CHUNK_SIZE < registry.count; c++) {
+		size_t n = registry.count - c * CHUNK_SIZE;
+		size_t *size = registry.chunk[c]->size;
+		if (n > CHUNK_SIZE) {
+			n = CHUNK_SIZE;
+		}
+		for (size_t i = 0; i < n; i++) {
+			bytes += size[i];
+		}
+	}
+
+	stats->blocks = registry.count;
+	stats->bytes = bytes;
+	stats->charged = __atomic_load_n(&budget.bytes, __ATOMIC_RELAXED);
+}
+
+const char *
+cclass_intern(const char *s,
+	      const char *file,
+	      int line)
+{
+	size_t hash = 0xcbf29ce484222325ull;
+	size_t length = 0;
+	const char *ret = 0;
+	size_t h;
+
+	if (!s) {
+		return 0;
+	}
+
+	/* FNV-1a hash, measuring the string on the way */
+	for (const unsigned char *c = (const unsigned char *) s; *c; c++) {
+		hash = (hash ^ *c) * 0x100000001b3ull;
+		length++;
+	}
+
+	intern.info.lookups++;
+
+	/* Grow table at half load */
+	if (2 * (intern.info.strings + 1) > intern.size) {
+		size_t size = intern.size ? 2 * intern.size : 256;
+		const char **table = (const char **)
+		    calloc(size, sizeof(char *));
+		if (table) {
+			const char **old = intern.table;
+			size_t old_size = intern.size;
+			intern.table = table;
+			intern.size = size;
+			for (size_t i = 0; i < old_size; i++) {
+				if (old[i]) {
+					h = intern_slot(old[i],
+							INTERNED(old[i])->hash);
+					intern.table[h] = old[i];
+				}
+			}
+			free(old);
+		}
+	}
+
+	h = (intern.size ? intern_slot(s, hash) : 0);
+	if (intern.size && intern.table[h]) {
+		/* Hit: share the copy */
+		INTERNED(intern.table[h])->refs++;
+		intern.info.hits++;
+		ret = intern.table[h];
+	} else if (2 * (intern.info.strings + 1) <= intern.size) {
+		interned *i = (interned *)
+		    cclass_malloc(sizeof(interned) + length + 1,
+				  &intern_classdesc, file, line);
+		if (i) {
+			i->refs = 1;
+			i->hash = hash;
+			memcpy(i->str, s, length + 1);
+			intern.table[h] = i->str;
+			intern.info.strings++;
+			intern.info.bytes += length + 1;
+			ret = i->str;
+		}
+	} else {
+		/* Miss with no room: the table could not grow */
+		asserterror();
+	}
+
+	return ret;
+}
+
+void
+cclass_intern_stats(cclass_intern_info *info)
+{
+	*info = intern.info;
+}
+
+bool
+cclass_latency(classdesc *desc,
+	       cclass_latency_op op,
+	       cclass_latency_info *info)
+{
+	const struct cclass_histograms_tag *hs =
+	    (desc ? desc->latency : &latency.all);
+
+	return latency_read(hs ? &hs->op[op] : 0, info);
+}
+
+void
+cclass_latency_report(void)
+{
+	static const char *ops[CCLASS_LATENCY_OPS] = {
+		"malloc", "realloc", "free"
+	};
+
+	for (struct cclass_histograms_tag *hs = latency.list; hs;
+	     hs = hs->next) {
+		for (int op = 0; op < CCLASS_LATENCY_OPS; op++) {
+			cclass_latency_info info;
+			if (!latency_read(&hs->op[op], &info)) {
+				continue;
+			}
+			if (hs->class) {
+				printf("%s: %-24s", __func__, hs->class->name);
+			} else {
+				printf("%s: %19s %4ld", __func__,
+				       sites.site[hs->site].file,
+				       sites.site[hs->site].line);
+			}
+			printf(" %-7s %8zu p50 %lu p99 %lu p999 %lu "
+			       "max %lu ns\n", ops[op], info.count, info.p50,
+			       info.p99, info.p999, info.max);
+		}
+	}
+}
+
+void *
+object_alloc(size_t size,
+	     classdesc *class,
+	     prefix *near,
+	     const char *file,
+	     int line)
+{
+	prefix *p;
+	size_t pad;
+	unsigned id = 0;
+	LATENCY_START(start);
+
+	CCLASS_PROBE4(malloc_entry, size, CCLASS_PROBE_CLASS(class), file,
+		      line);
+	if (size > SIZE_LIMIT) {
+		/* Report out of memory error */
+		asserterror();
+		CCLASS_PROBE5(malloc_return, 0, size,
+			      CCLASS_PROBE_CLASS(class), file, line);
+		return 0;
+	}
+	pad = DOALIGN(size) - size;
+	size = DOALIGN(size);
+	if (!budget_charge(class, BLOCKSIZE(size), 0)) {
+		/* Refused by budget */
+		CCLASS_PROBE5(malloc_return, 0, size,
+			      CCLASS_PROBE_CLASS(class), file, line);
+		return 0;
+	}
+	p = block_alloc(size, class, near);
+	if (p) {
+		id = site_lookup(file, line);
+		p->class = class;
+		if (class_reserve(class, 1) &&
+		    registry_insert(p, size, pad, id)) {
+			p->postfix = (postfix *) ((char *) (p + 1) + size);
+			p->postfix->prefix = p;
+			p->mem = p + 1;
+			p->refs = 1;
+			CHUNK(p->index)->stack[SLOT(p->index)] = STACK_SAMPLE();
+			class_insert(p);
+			METRICS(class, id, 1, size);
+			TRACE(CCLASS_TRACE_MALLOC, class, id, p + 1, 0, size);
+			if (class && class->init) {
+				class->init(p->mem);
+			}
+		} else {
+			block_free(p, size);
+			p = 0;
+		}
+	}
+	if (!p) {
+		/* Report out of memory error */
+		budget_uncharge(class, BLOCKSIZE(size));
+		asserterror();
+	} else {
+		LATENCY(class, id, CCLASS_LATENCY_MALLOC, start);
+	}
+	CCLASS_PROBE5(malloc_return, (p ? p + 1 : 0), size,
+		      CCLASS_PROBE_CLASS(class), file, line);
+
+	return (p ? p + 1 : 0);
+}
+
+void *
+cclass_malloc(size_t size,
+	      classdesc *class,
+	      const char *file,
+	      int line)
+{
+	return object_alloc(size, class, 0, file, line);
+}
+
+void **
+cclass_malloc_batch(size_t n,
+		    size_t size,
+		    classdesc *class,
+		    void **mem,
+		    const char *file,
+		    int line)
+{
+	origin *s = 0;
+	size_t stride;
+	size_t first = 0;
+	size_t i = 0;
+	unsigned id = 0;
+	size_t pad = DOALIGN(size) - size;
+	LATENCY_START(start);
+
+	CCLASS_PROBE5(malloc_batch_entry, n, size, CCLASS_PROBE_CLASS(class),
+		      file, line);
+	if (size > SIZE_LIMIT - SLAB_ALIGNMENT) {
+		/* Report out of memory error */
+		asserterror();
+		CCLASS_PROBE6(malloc_batch_return, 0, n, size,
+			      CCLASS_PROBE_CLASS(class), file, line);
+		return 0;
+	}
+	size = DOALIGN(size);
+	stride = SLAB_ALIGN(BLOCKSIZE(size));
+
+	/* One registry update, and one allocation unless from arena */
+	if (!n || stride > ((size_t) -1 - sizeof(origin)) / n) {
+		CCLASS_PROBE6(malloc_batch_return, 0, n, size,
+			      CCLASS_PROBE_CLASS(class), file, line);
+		return 0;
+	}
+	if (!budget_charge(class, n * BLOCKSIZE(size), 0)) {
+		/* Refused by budget */
+		CCLASS_PROBE6(malloc_batch_return, 0, n, size,
+			      CCLASS_PROBE_CLASS(class), file, line);
+		return 0;
+	}
+	if (class_reserve(class, n) && registry_reserve(n)) {
+		id = site_lookup(file, line);
+		unsigned trail = STACK_SAMPLE();
+		bool from_arena = arena_selects(class, size);
+		for (i = 0; i < n; i++) {
+			prefix *p = 0;
+			if (from_arena) {
+				region *r;
+				p = (prefix *) arena_get(&huge_arena,
+							 BLOCKSIZE(size), &r);
+				if (p) {
+					p->origin = &r->origin;
+				}
+			}
+			if (!p && !s) {
+				/* Rest of the batch from one backend slab */
+				s = slab_alloc(n - i, stride, class);
+				if (!s) {
+					break;
+				}
+				from_arena = false;
+				first = i;
+			}
+			if (!p) {
+				p = (prefix *) ((char *) (s + 1) +
+						(i - first) * stride);
+				p->origin = s;
+			}
+			p->class = class;
+			registry_insert(p, size, pad, id);
+			p->postfix = (postfix *) ((char *) (p + 1) + size);
+			p->postfix->prefix = p;
+			p->mem = p + 1;
+			p->refs = 1;
+			CHUNK(p->index)->stack[SLOT(p->index)] = trail;
+			class_insert(p);
+			mem[i] = p->mem;
+		}
+	}
+	if (i < n) {
+		/* Undo partial batch and report out of memory error */
+		while (i--) {
+			prefix *p = (prefix *) mem[i] - 1;
+			class_remove(p);
+			registry_remove(p);
+			block_free(p, size);
+			mem[i] = 0;
+		}
+		budget_uncharge(class, n * BLOCKSIZE(size));
+		asserterror();
+		CCLASS_PROBE6(malloc_batch_return, 0, n, size,
+			      CCLASS_PROBE_CLASS(class), file, line);
+		return 0;
+	}
+	METRICS(class, id, n, n * size);
+	for (i = 0; trace.fd >= 0 && i < n; i++) {
+		trace_event(CCLASS_TRACE_MALLOC, class, id, mem[i], 0, size);
+	}
+	if (class && class->init) {
+		for (i = 0; i < n; i++) {
+			class->init(mem[i]);
+		}
+	}
+	LATENCY_BATCH(class, id, CCLASS_LATENCY_MALLOC, start, n);
+	CCLASS_PROBE6(malloc_batch_return, mem, n, size,
+		      CCLASS_PROBE_CLASS(class), file, line);
+
+	return mem;
+}
+
+void *
+cclass_malloc_child(size_t size,
+		    classdesc *class,
+		    void *parent,
+		    const char *file,
+		    int line)
+{
+	prefix *pp = (prefix *) parent - 1;
+	family *owner;
+	family *f;
+	void *mem;
+
+	if (!list_verify(parent)) {
+		return 0;
+	}
+	owner = family_get(pp, true);
+	if (!owner) {
+		asserterror();
+		return 0;
+	}
+
+	mem = object_alloc(size, class, pp, file, line);
+	if (!mem) {
+		return 0;
+	}
+	f = family_get((prefix *) mem - 1, true);
+	if (!f) {
+		cclass_free(mem);
+		asserterror();
+		return 0;
+	}
+
+	/* Link as first owned object */
+	f->parent = owner;
+	f->next = owner->child;
+	if (owner->child) {
+		owner->child->prev = f;
+	}
+	owner->child = f;
+
+	return mem;
+}
+
+void *
+cclass_malloc_near(size_t size,
+		   classdesc *class,
+		   void *hint,
+		   const char *file,
+		   int line)
+{
+	prefix *near = 0;
+
+	if (hint && list_verify(hint)) {
+		near = (prefix *) hint - 1;
+	}
+
+	return object_alloc(size, class, near, file, line);
+}
+
+void
+cclass_overhead_stats(classdesc *desc,
+		      cclass_overhead *info)
+{
+	memset(info, 0, sizeof(*info));
+	for (size_t index = 0; index < registry.count; index++) {
+		chunk *c = CHUNK(index);
+		if (!desc || c->class[SLOT(index)] == desc) {
+			overhead_add(info, c, SLOT(index));
+		}
+	}
+
+	/* Arena space not handed out */
+	if (!desc) {
+		arena *arenas[3] = {
+			&huge_arena, &reserve_arena,
+			(persist ? &persist->arena : 0),
+		};
+		for (int i = 0; i < 3 && arenas[i]; i++) {
+			size_t mapped = 0;
+			for (region *r = arenas[i]->regions; r; r = r->next) {
+				mapped += REGION_SIZE;
+			}
+			info->arena_free += mapped - arenas[i]->used;
+		}
+	}
+	overhead_ratio(info);
+}
+
+void
+cclass_overhead_report(void)
+{
+	classdesc **class = 0;
+	cclass_overhead *account = 0;
+	size_t classes = 0;
+	cclass_overhead all;
+
+	/* Gather an account per class in one registry scan */
+	for (size_t index = 0; index < registry.count; index++) {
+		chunk *c = CHUNK(index);
+		size_t i = 0;
+		while (i < classes && class[i] != c->class[SLOT(index)]) {
+			i++;
+		}
+		if (i == classes && !(classes & (classes + 1))) {
+			/* Grow to the next power of two minus one */
+			classdesc **more = (classdesc **)
+			    realloc(class, (2 * classes + 1) * sizeof(*class));
+			cclass_overhead *accounts = (cclass_overhead *)
+			    realloc(account, (2 * classes + 1) *
+				    sizeof(*account));
+			class = (more ? more : class);
+			account = (accounts ? accounts : account);
+			if (!more || !accounts) {
+				break;
+			}
+		}
+		if (i == classes) {
+			class[classes] = c->class[SLOT(index)];
+			memset(&account[classes++], 0, sizeof(*account));
+		}
+		overhead_add(&account[i], c, SLOT(index));
+	}
+
+	printf("%s: %-16s %8s %10s %8s %8s %8s %8s %6s\n", __func__,
+	       "class", "objects", "payload", "rounding", "headers",
+	       "slack", "registry", "frag");
+	cclass_overhead_stats(0, &all);
+	for (size_t i = 0; i <= classes; i++) {
+		cclass_overhead *o = (i < classes ? &account[i] : &all);
+		const char *name = (i == classes ? "(all)" :
+				    class[i] ? class[i]->name : "(none)");
+		if (i < classes) {
+			overhead_ratio(o);
+		}
+		printf("%s: %-16s %8zu %10zu %8zu %8zu %8zu %8zu %5.1f%%\n",
+		       __func__, name, o->blocks, o->payload, o->rounding,
+		       o->headers, o->slack, o->registry,
+		       100 * o->fragmentation);
+	}
+	if (all.arena_free) {
+		printf("%s: %zu arena bytes free\n", __func__, all.arena_free);
+	}
+	free(class);
+	free(account);
+}
 
-void
-list_insert(prefix *p)
+void *
+cclass_parent(void *mem)
 {
-	/* add before current head of list */
-	if (heap) {
-		p->prev = heap->prev;
-		(p->prev)->next = p;
-		p->next = heap;
-		(p->next)->prev = p;
-	}
+	family *f;
 
-	/* else first node */
-	else {
-		p->prev = p;
-		p->next = p;
+	if (!list_verify(mem)) {
+		return 0;
 	}
+	f = CHUNK(((prefix *) mem - 1)->index)->
+	    family[SLOT(((prefix *) mem - 1)->index)];
 
-	/* make new item head of list */
-	heap = p;
+	return (f && f->parent ? f->parent->self->mem : 0);
 }
 
 void
-list_remove(prefix *p)
+cclass_persist_close(void)
 {
-	/* Remove from doubly linked list */
-	(p->prev)->next = p->next;
-	(p->next)->prev = p->prev;
-
-	/* Possibly correct head pointer */
-	if (p == heap) {
-		heap = ((p->next == p) ? 0 : p->next);
+	if (persist) {
+		persist_detach(persist);
+		for (size_t i = 0; i < persist->classes; i++) {
+			persist->class[i].desc->flags &= ~CCLASS_PERSISTENT;
+		}
+		msync(persist, persist->size, MS_SYNC);
+		munmap(persist, persist->size);
+		persist = 0;
 	}
 }
 
 bool
-list_verify(void *mem)
+cclass_persist_open(const char *path,
+		    void *base,
+		    size_t size,
+		    classdesc **classes,
+		    size_t n)
 {
-	bool ok = false;
+	int fd;
 
-	if (mem) {
-		XASSERT(cclass_test_pointer(mem)) {
-			prefix *p = (prefix *) mem - 1;
-			XASSERT(p->mem == mem) {
-				XASSERT(p->postfix->prefix == p) {
-					ok = true;
-				}
-			}
-		}
+	if (persist || !base || n > PERSIST_CLASSES) {
+		return false;
 	}
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
 
-	return (ok);
+	return (fd >= 0 && persist_map(fd, true, false, base, size, classes,
+				       n));
+}
+
+void *
+cclass_persist_root(void)
+{
+	return (persist ? persist->root : 0);
 }
 
 void
-render(prefix *p, char *buffer)
+cclass_persist_set_root(void *root)
 {
-	if (p->mem == &p[1]) {
-		sprintf(buffer, "%8p ", p);
-		if (p->file) {
-			sprintf(buffer + strlen(buffer), "%12s %4ld ",
-				p->file, p->line);
-		}
-		if (p->class) {
-			sprintf(buffer + strlen(buffer), "%s",
-				p->class->name);
-		}
-	} else {
-		strcpy(buffer, "(bad)");
+	if (persist) {
+		persist->root = root;
 	}
 }
 
-void *
-cclass_free(void *mem)
+bool
+cclass_persist_sync(void)
 {
-	if (list_verify(mem)) {
-		prefix *p = (prefix *) mem - 1;
-		size_t size = (char *) (p->postfix + 1) - (char *) p;
-		list_remove(p);
-		memset(p, 0, size);
-		free(p);
+	return (persist && !msync(persist, persist->size, MS_SYNC));
+}
+
+bool
+cclass_profile_load(const char *path,
+		    classdesc **classes,
+		    size_t n)
+{
+	static bool registered = false;
+	char name[256];
+	size_t peak;
+	size_t bytes;
+	FILE *file;
+	bool ok = true;
+
+	/* Remember where to write the peaks of this run */
+	free(profile.path);
+	free(profile.classes);
+	memset(&profile, 0, sizeof(profile));
+	if (!path) {
+		return false;
+	}
+	profile.path = strdup(path);
+	profile.classes = (classdesc **) malloc(n * sizeof(classdesc *));
+	profile.n = n;
+	if (!profile.path || !profile.classes) {
+		free(profile.path);
+		free(profile.classes);
+		memset(&profile, 0, sizeof(profile));
+		return false;
+	}
+	memcpy(profile.classes, classes, n * sizeof(classdesc *));
+	if (!registered) {
+		registered = !atexit(profile_exit);
 	}
 
-	return 0;
+	/* No profile yet on the first run */
+	file = fopen(path, "r");
+	if (!file) {
+		return false;
+	}
+	while (fscanf(file, "%zu %zu %255[^\n]", &peak, &bytes, name) == 3) {
+		for (size_t i = 0; i < n; i++) {
+			if (!strcmp(classes[i]->name, name) && peak) {
+				/* Object size from average block size */
+				size_t size = bytes / peak;
+				size -= (size > BLOCKSIZE(0) ? BLOCKSIZE(0) :
+					 size);
+				ok &= cclass_class_reserve(classes[i], peak,
+							   size);
+			}
+		}
+	}
+	fclose(file);
+
+	return ok;
 }
 
-void *
-cclass_malloc(size_t size,
-	      classdesc *class,
-	      const char *file,
-	      int line)
+bool
+cclass_profile_save(void)
 {
-	prefix *p;
-	size = DOALIGN(size);
-	p = (prefix *) malloc(sizeof(prefix) + size + sizeof(postfix));
-	if (p) {
-		list_insert(p);
-		p->postfix = (postfix *) ((char *) (p + 1) + size);
-		p->postfix->prefix = p;
-		p->file = file;
-		p->line = line;
-		p->mem = p + 1;
-		p->class = class;
-		memset(p->mem, 0, size);
-	} else {
-		/* Report out of memory error */
-		asserterror();
+	char tmp[PATH_MAX];
+	FILE *file;
+	bool ok;
+
+	if (!profile.path ||
+	    snprintf(tmp, sizeof(tmp), "%s.tmp", profile.path) >=
+	    (int) sizeof(tmp)) {
+		return false;
 	}
 
-	return (p ? p + 1 : 0);
+	/* Replace the profile whole, never leave a partial one */
+	file = fopen(tmp, "w");
+	if (!file) {
+		return false;
+	}
+	for (size_t i = 0; i < profile.n; i++) {
+		classdesc *class = profile.classes[i];
+		if (class->peak) {
+			fprintf(file, "%zu %zu %s\n", class->peak,
+				class->peak_bytes, class->name);
+		}
+	}
+	ok = !ferror(file);
+	ok &= !fclose(file);
+	if (!ok || rename(tmp, profile.path)) {
+		unlink(tmp);
+		return false;
+	}
+
+	return true;
+}
+
+void
+profile_exit(void)
+{
+	cclass_profile_save();
 }
 
 void *
@@ -225,45 +3707,404 @@ cclass_realloc(void *old,
 	       int line)
 {
 	void *new = 0;
+	LATENCY_START(start);
+
+	CCLASS_PROBE4(realloc_entry, old, size, file, line);
 
 	/* Try to realloc */
-	if (old) {
+	if (old && size > SIZE_LIMIT) {
+		/* Report out of memory error, keep old block */
+		asserterror();
+		CCLASS_PROBE6(realloc_return, 0, old, size, "", file, line);
+	} else if (old) {
 		if (list_verify(old)) {
 			prefix *p = (prefix *) old - 1;
 			prefix *new_p;
+			chunk *c = CHUNK(p->index);
+			size_t slot = SLOT(p->index);
+			size_t pad = DOALIGN(size) - size;
+			classdesc *class = p->class; /* p may be freed below */
+			budget_signal signal = { false, false, 0, 0 };
+
+			/* Growth is charged up front, pressure signalled last */
+			size = DOALIGN(size);
+			if (size > c->size[slot] &&
+			    !budget_charge(class, size - c->size[slot],
+					   &signal)) {
+				/* Refused by budget, keep old block */
+				CCLASS_PROBE6(realloc_return, 0, old, size,
+					      CCLASS_PROBE_CLASS(class),
+					      file, line);
+				budget_signal_call(class, &signal);
+				return 0;
+			}
 
 			/* Try to reallocate block */
-			list_remove(p);
 			memset(p->postfix, 0, sizeof(postfix));
-			size = DOALIGN(size);
-			new_p = (prefix *) realloc(p, sizeof(prefix) +
-						   size + sizeof(postfix));
+			if (!p->origin) {
+				new_p = (prefix *)
+				    backend->realloc(p, BLOCKSIZE(size));
+			} else if (p->origin->kind == ORIGIN_REGION &&
+				   BLOCKSIZE(size) <= ARENA_MAX &&
+				   arena_class(BLOCKSIZE(size)) ==
+				   arena_class(BLOCKSIZE(c->size[slot]))) {
+				/* Fits arena block, keep free tail zeroed */
+				new_p = p;
+				if (size < c->size[slot]) {
+					memset((char *) (p + 1) + size, 0,
+					       c->size[slot] - size);
+				}
+			} else {
+				/* Move out of batch slab or arena block */
+				new_p = block_alloc(size, class, 0);
+				if (new_p) {
+					origin *o = new_p->origin;
+					size_t keep = c->size[slot];
+					keep = (keep < size ? keep : size);
+					memcpy(new_p, p, sizeof(prefix) + keep);
+					new_p->origin = o;
+					block_free(p, c->size[slot]);
+				}
+			}
+
+			/* Settle budget for the size change */
+			if (!new_p && size > c->size[slot]) {
+				budget_uncharge(class, size - c->size[slot]);
+			} else if (new_p && size < c->size[slot]) {
+				budget_uncharge(class, c->size[slot] - size);
+			}
 
-			/* Add new (or failed old) back in */
-			p = (new_p ? new_p : p);
-			list_insert(p);
+			/* Update registry entry of new (or failed old) */
+			if (new_p) {
+				METRICS(class, c->site[slot], 0,
+					(long) size - (long) c->size[slot]);
+				TRACE(CCLASS_TRACE_REALLOC, class,
+				      c->site[slot], &new_p[1], old, size);
+				p = new_p;
+				c->block[slot] = p;
+				if (c->family[slot]) {
+					c->family[slot]->self = p;
+				}
+				if (c->handle[slot]) {
+					handles.entry[c->handle[slot] - 1].mem =
+					    p + 1;
+				}
+				c->size[slot] = size;
+				c->pad[slot] = pad;
+			} else {
+				size = c->size[slot];
+			}
 			p->postfix = (postfix *) ((char *) (p + 1) + size);
 			p->postfix->prefix = p;
 			p->mem = p + 1;
+			if (class) {
+				class->objects[p->class_index] = p->mem;
+			}
 
 			/* Finish */
 			new = (new_p ? &new_p[1] : 0);
 			if (!new) {
 				/* Report out of memory error */
 				asserterror();
+			} else {
+				LATENCY(class, c->site[slot],
+					CCLASS_LATENCY_REALLOC, start);
 			}
+			CCLASS_PROBE6(realloc_return, new, old, size,
+				      CCLASS_PROBE_CLASS(class), file, line);
+			budget_signal_call(class, &signal);
+		} else {
+			CCLASS_PROBE6(realloc_return, 0, old, size, "", file,
+				      line);
 		}
 	}
 
 	/* Else try new allocation */
 	else {
 		new = cclass_malloc(size, 0, file, line);
+		CCLASS_PROBE6(realloc_return, new, old, size, "", file, line);
 	}
 
 	/* Return address to object */
 	return new;
 }
 
+void *
+cclass_release(void *mem)
+{
+	prefix *p = (prefix *) mem - 1;
+	unsigned refs;
+
+	XASSERT(cclass_test_pointer(mem) && p->mem == mem) {
+		/* Drop a reference, unless the last is already gone */
+		refs = __atomic_load_n(&p->refs, __ATOMIC_RELAXED);
+		while (refs &&
+		       !__atomic_compare_exchange_n(&p->refs, &refs, refs - 1,
+						    true, __ATOMIC_ACQ_REL,
+						    __ATOMIC_RELAXED)) {
+			/* retry */
+		}
+		XASSERT(refs) {
+			if (refs == 1) {
+				cclass_free(mem);
+			}
+		}
+	}
+
+	return 0;
+}
+
+void *
+cclass_retain(void *mem)
+{
+	prefix *p = (prefix *) mem - 1;
+	unsigned refs;
+
+	if (!cclass_test_pointer(mem) || p->mem != mem) {
+		return 0;
+	}
+
+	/* Never revive an object whose last reference is gone */
+	refs = __atomic_load_n(&p->refs, __ATOMIC_RELAXED);
+	while (refs && refs != UINT_MAX &&
+	       !__atomic_compare_exchange_n(&p->refs, &refs, refs + 1,
+					    true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) {
+		/* retry */
+	}
+
+	return (refs && refs != UINT_MAX ? mem : 0);
+}
+
+void
+cclass_set_latency(bool enable)
+{
+	/* Calibrate ticks against the monotonic clock once */
+	if (enable && !latency.ns_per_tick) {
+#if defined(__x86_64__) || defined(__i386__)
+		struct timespec from, to;
+		uint64_t t0, t1;
+		double ns;
+		clock_gettime(CLOCK_MONOTONIC, &from);
+		t0 = ticks();
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &to);
+			ns = (to.tv_sec - from.tv_sec) * 1e9 +
+			     (to.tv_nsec - from.tv_nsec);
+		} while (ns < 2e6);
+		t1 = ticks();
+		latency.ns_per_tick = (t1 > t0 ? ns / (t1 - t0) : 1);
+#else
+		latency.ns_per_tick = 1;
+#endif
+	}
+	latency.enabled = enable;
+}
+
+size_t
+cclass_set_reserve(size_t bytes)
+{
+	size_t reserved = 0;
+	region *r;
+
+	for (r = reserve_arena.regions; r; r = r->next) {
+		reserved += REGION_SIZE;
+	}
+	while (reserved < bytes && region_map(&reserve_arena)) {
+		reserved += REGION_SIZE;
+	}
+
+	return reserved;
+}
+
+const cclass_backend *
+cclass_set_backend(const cclass_backend *new)
+{
+	const cclass_backend *old = backend;
+
+	/* Objects must be freed by the backend that allocated them */
+	XASSERT(!registry.count) {
+		backend = (new ? new : &libc_backend);
+		return old;
+	}
+
+	return 0;
+}
+
+void
+cclass_set_backtrace(unsigned depth,
+		     unsigned period)
+{
+	void *frame[1];
+
+	/* Load the unwinder now, rather than inside an allocation */
+	if (depth && !stacks.depth) {
+		backtrace(frame, 1);
+		if (!stacks.text_size) {
+			dl_iterate_phdr(stack_text, 0);
+		}
+	}
+	stacks.depth = (depth < STACK_DEPTH ? depth : STACK_DEPTH);
+	stacks.period = (period ? period : 1);
+	stacks.countdown = stacks.period;
+}
+
+const cclass_metrics *
+cclass_metrics_publish(void)
+{
+	static bool registered = false;
+	char name[32];
+	cclass_metrics *m;
+	int fd;
+
+	if (metrics) {
+		return metrics;
+	}
+
+	snprintf(name, sizeof(name), CCLASS_METRICS_PATH, (int) getpid());
+	fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd < 0) {
+		return 0;
+	}
+	m = MAP_FAILED;
+	if (!ftruncate(fd, sizeof(cclass_metrics))) {
+		m = mmap(0, sizeof(cclass_metrics), PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (m == MAP_FAILED) {
+		shm_unlink(name);
+		return 0;
+	}
+
+	m->version = CCLASS_METRICS_VERSION;
+	m->pid = getpid();
+	m->classes = 1;
+	strcpy(m->class[0].name, "(none)");
+	strcpy(m->class[CCLASS_METRICS_CLASSES - 1].name, "(other)");
+	strcpy(m->site[0].file, "(unknown)");
+	strcpy(m->site[CCLASS_METRICS_SITES - 1].file, "(other)");
+	metrics = m;
+	metrics_epoch++;
+	for (unsigned id = 1; id < sites.count; id++) {
+		metrics_site(id);
+	}
+
+	/* Start out with the objects already on the heap */
+	for (size_t index = 0; index < registry.count; index++) {
+		chunk *c = CHUNK(index);
+		metrics_count(c->class[SLOT(index)], c->site[SLOT(index)], 1,
+			      c->size[SLOT(index)]);
+	}
+
+	/* Readers check magic last */
+	__atomic_store_n(&m->magic, CCLASS_METRICS_MAGIC, __ATOMIC_RELEASE);
+	if (!registered) {
+		registered = !atexit(cclass_metrics_unpublish);
+	}
+
+	return m;
+}
+
+void
+cclass_metrics_unpublish(void)
+{
+	if (metrics) {
+		char name[32];
+		snprintf(name, sizeof(name), CCLASS_METRICS_PATH,
+			 (int) metrics->pid);
+		munmap(metrics, sizeof(cclass_metrics));
+		metrics = 0;
+		shm_unlink(name);
+	}
+}
+
+void
+cclass_set_budget(size_t limit,
+		  size_t soft_limit,
+		  void (*pressure)(classdesc *desc, size_t bytes))
+{
+	budget.budget = limit;
+	budget.soft_limit = soft_limit;
+	budget.pressure = pressure;
+}
+
+void
+cclass_set_hugepage(bool enable)
+{
+	huge_arena.all = enable;
+}
+
+bool
+cclass_shared_open(const char *name,
+		   void *base,
+		   size_t size,
+		   classdesc **classes,
+		   size_t n)
+{
+	bool create = true;
+	int fd;
+
+	if (persist || !base || n > PERSIST_CLASSES) {
+		return false;
+	}
+
+	/* Only the process creating the segment lays it out */
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		create = false;
+		fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	}
+
+	return (fd >= 0 && persist_map(fd, create, true, base, size, classes,
+				       n));
+}
+
+void
+cclass_stack_report(void)
+{
+	size_t *blocks;
+	size_t *bytes;
+
+	if (stacks.count < 2) {
+		return;
+	}
+	blocks = (size_t *) calloc(2 * stacks.count, sizeof(size_t));
+	if (!blocks) {
+		return;
+	}
+	bytes = blocks + stacks.count;
+
+	/* Gather an account per stack in one registry scan */
+	for (size_t index = 0; index < registry.count; index++) {
+		chunk *c = CHUNK(index);
+		unsigned id = c->stack[SLOT(index)];
+		blocks[id]++;
+		bytes[id] += c->size[SLOT(index)];
+	}
+
+	for (unsigned id = 1; id < stacks.count; id++) {
+		stack *k = &stacks.stack[id];
+		char **symbol;
+		if (!blocks[id]) {
+			continue;
+		}
+		printf("%s: #%u %zu blocks %zu bytes\n", __func__, id,
+		       blocks[id], bytes[id]);
+		symbol = backtrace_symbols(&stacks.frame[k->frame], k->depth);
+		for (unsigned i = 0; i < k->depth; i++) {
+			printf("%s:     %s\n", __func__,
+			       symbol ? symbol[i] : "?");
+		}
+		free(symbol);
+	}
+	if (blocks[0]) {
+		printf("%s: %zu blocks %zu bytes without stack\n", __func__,
+		       blocks[0], bytes[0]);
+	}
+	free(blocks);
+}
+
 void *
 cclass_strdup(const char *s,
 	      const char *file,
@@ -287,24 +4128,210 @@ cclass_test_pointer(void *mem)
 	return ((mem) && (!((long) mem & (ALIGNMENT - 1))));
 }
 
+bool
+cclass_trace_start(const char *path)
+{
+	static bool registered = false;
+	cclass_trace_header header = {
+		.magic = CCLASS_TRACE_MAGIC,
+		.version = CCLASS_TRACE_VERSION,
+		.event_size = sizeof(cclass_trace_event),
+		.pid = (uint32_t) getpid(),
+	};
+	int fd;
+
+	if (trace.fd >= 0) {
+		return false;
+	}
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return false;
+	}
+
+	trace.epoch++;
+	clock_gettime(CLOCK_MONOTONIC, &trace.start);
+	trace.fd = fd;
+	for (unsigned id = 1; id < sites.count; id++) {
+		trace_name(CCLASS_TRACE_SITE, id, sites.site[id].line,
+			   sites.site[id].file);
+	}
+	if (!registered) {
+		registered = !atexit(cclass_trace_stop);
+	}
+
+	return true;
+}
+
+void
+cclass_trace_stop(void)
+{
+	if (trace.fd >= 0) {
+		for (trace_buffer *b = trace.buffers; b; b = b->next) {
+			trace_flush(b);
+		}
+		close(trace.fd);
+		trace.fd = -1;
+	}
+}
+
+size_t
+cclass_trim(unsigned decay)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t released = 0;
+	size_t carved = 0;
+	struct timespec now;
+	uint64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+	for (region **link = &huge_arena.regions; *link;) {
+		region *r = *link;
+		uint64_t seen = region_activity(r);
+		if (seen != r->trim_seen || !r->trim_since) {
+			/* Changed since the last pass, decay from now */
+			r->trim_seen = seen;
+			r->trim_since = ms;
+			r->trim_released = 0;
+		}
+		if (ms - r->trim_since >= decay && !r->origin.live) {
+			released += REGION_SIZE;
+			region_unmap(link);
+			continue;
+		} else if (ms - r->trim_since >= decay && !r->trim_released) {
+			r->trim_released = region_trim(r, page);
+			released += r->trim_released;
+		}
+		carved += (size_t) (r->bump - (char *) r) - REGION_HEADER -
+			  r->trim_released;
+		link = &r->next;
+	}
+
+	/* Atomic, as cclass_trim_stats() reads without the heap lock */
+	__atomic_add_fetch(&trim.info.released, released, __ATOMIC_RELAXED);
+	__atomic_store_n(&trim.info.retained, carved - huge_arena.used,
+			 __ATOMIC_RELAXED);
+	__atomic_add_fetch(&trim.info.passes, 1, __ATOMIC_RELAXED);
+
+	return released;
+}
+
+bool
+cclass_trim_start(unsigned decay,
+		  pthread_mutex_t *lock)
+{
+	/* A decay of 0 would pass without ever sleeping */
+	if (trim.running || !lock || !decay) {
+		return false;
+	}
+	trim.lock = lock;
+	trim.decay = decay;
+	trim.stop = false;
+	trim.running = !pthread_create(&trim.thread, 0, trim_main, 0);
+
+	return trim.running;
+}
+
+void
+cclass_trim_stats(cclass_trim_info *info)
+{
+	info->released = __atomic_load_n(&trim.info.released,
+					 __ATOMIC_RELAXED);
+	info->retained = __atomic_load_n(&trim.info.retained,
+					 __ATOMIC_RELAXED);
+	info->passes = __atomic_load_n(&trim.info.passes, __ATOMIC_RELAXED);
+}
+
+void
+cclass_trim_stop(void)
+{
+	if (trim.running) {
+		pthread_mutex_lock(&trim.wake_lock);
+		trim.stop = true;
+		pthread_cond_signal(&trim.wake);
+		pthread_mutex_unlock(&trim.wake_lock);
+		pthread_join(trim.thread, 0);
+		trim.running = false;
+	}
+}
+
+const char *
+cclass_unintern(const char *s)
+{
+	if (!s) {
+		return 0;
+	}
+
+	XASSERT(list_verify(INTERNED(s)) &&
+		((prefix *) INTERNED(s) - 1)->class == &intern_classdesc) {
+		interned *i = INTERNED(s);
+		if (!--i->refs) {
+			size_t mask = intern.size - 1;
+			size_t h = intern_slot(s, i->hash);
+
+			/* Shift later entries of the probe run back */
+			for (size_t next = (h + 1) & mask; intern.table[next];
+			     next = (next + 1) & mask) {
+				size_t home = INTERNED(intern.table[next])->hash &
+					      mask;
+				if (((next - home) & mask) >=
+				    ((next - h) & mask)) {
+					intern.table[h] = intern.table[next];
+					h = next;
+				}
+			}
+			intern.table[h] = 0;
+			intern.info.strings--;
+			intern.info.bytes -= strlen(s) + 1;
+			cclass_free(i);
+		}
+	}
+
+	return 0;
+}
+
+size_t
+cclass_usable_size(void *mem)
+{
+	prefix *p = (prefix *) mem - 1;
+
+	/* Quietly, for pointers that may not be heap objects */
+	if (!cclass_test_pointer(mem) || p->mem != mem ||
+	    p->index >= registry.count ||
+	    CHUNK(p->index)->block[SLOT(p->index)] != p) {
+		return 0;
+	}
+
+	return (size_t) ((char *) p->postfix - (char *) mem);
+}
+
 int
 cclass_walk_heap()
 {
 	int alloced = 0;
 
-	if (heap) {
-		prefix *p = heap;
-		while (list_verify(&p[1])) {
-			char buffer[100];
-			render(p, buffer);
-			printf("%s: %s\n", __func__, buffer);
+	for (size_t index = 0; index < registry.count; index++) {
+		chunk *c = CHUNK(index);
+		prefix *p = c->block[SLOT(index)];
+		char buffer[160];
 
-			alloced++;
-			p = p->next;
-			if (p == heap) {
-				break;
-			}
+		/* Fetch headers ahead of the sequential registry scan */
+		if (index + PREFETCH_AHEAD < registry.count) {
+			size_t ahead = index + PREFETCH_AHEAD;
+			__builtin_prefetch(CHUNK(ahead)->block[SLOT(ahead)]);
+		}
+
+		if (!list_verify(&p[1])) {
+			break;
 		}
+		render(p, buffer);
+		printf("%s: %s\n", __func__, buffer);
+
+		alloced++;
 	}
 
 	return alloced;
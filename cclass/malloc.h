@@ -24,14 +24,74 @@
 
 #include <cclass/assert.h> /* USE_XASSERT */
 #include <malloc.h> /* NULL */
+#include <pthread.h> /* pthread_mutex_t */
+#include <stdint.h> /* uint64_t */
 #include <sys/types.h> /* size_t */
 
 __BEGIN_DECLS
 
+/**
+ * @def CCLASS_HUGEPAGE
+ * @brief Class flag: allocate objects from the huge page arena
+ *
+ * Usage:
+ * @code
+ * CLASS_WITH(obj, obj_t, .flags = CCLASS_HUGEPAGE) {
+ *     // ...
+ * };
+ * @endcode
+ */
+#define CCLASS_HUGEPAGE 0x1
+
+/**
+ * @def CCLASS_CRITICAL
+ * @brief Class flag: objects are critical
+ *
+ * Allocation of critical objects is never refused by a budget, and is
+ * served from the emergency reserve (see cclass_set_reserve()) when the
+ * backend runs out of memory.
+ */
+#define CCLASS_CRITICAL 0x2
+
+/**
+ * @def CCLASS_PERSISTENT
+ * @brief Class flag: objects live in the persistent heap
+ *
+ * Set by cclass_persist_open() and cclass_shared_open() on the classes
+ * they are given, and cleared by cclass_persist_close().
+ */
+#define CCLASS_PERSISTENT 0x4
+
+/**
+ * @def FOREACHOBJ(obj,func,arg)
+ * @brief Call a function for every live object of a class
+ *
+ * Only the live objects of the class are visited, not the whole heap.
+ * The function may free the object it is called for.
+ *
+ * @param[in] obj  object name of the class, as used with NEWOBJ()
+ * @param[in] func  function to call as func(object, arg)
+ * @param[in] arg  argument passed to func
+ *
+ * @return number of objects visited
+ *
+ * Usage:
+ * @code
+ * static void flush(void *obj, void *arg) { ... }
+ * // ...
+ * FOREACHOBJ(obj, flush, NULL);
+ * @endcode
+ */
+#define FOREACHOBJ(obj,func,arg) \
+  cclass_class_foreach(&_CD(obj),func,arg)
+
 /**
  * @def FREEOBJ(obj)
  * @brief Free memory allocated memory for an object
  *
+ * The fini hook of the object's class, if any, is called first.  Of an
+ * object retained by others, only the caller's reference is dropped.
+ *
  * @param[in,out] obj  object to free
  *
  * Usage:
@@ -44,6 +104,63 @@ __BEGIN_DECLS
  */
 #define FREEOBJ(obj) (obj = cclass_free(obj))
 
+/**
+ * @def RELEASEOBJ(obj)
+ * @brief Release a reference to an object
+ *
+ * As FREEOBJ() for the last reference; other references keep the
+ * object alive.
+ *
+ * @param[in,out] obj  object to release, set to 0
+ *
+ * Usage:
+ * @code
+ * obj_t obj;
+ * NEWOBJ(obj);
+ * queue_push(cclass_retain(obj)); // consumer calls RELEASEOBJ() too
+ * RELEASEOBJ(obj);
+ * @endcode
+ */
+#define RELEASEOBJ(obj) (obj = cclass_release(obj))
+
+/**
+ * @def FREEOBJ_BATCH(array,n)
+ * @brief Free memory allocated for an array of objects
+ *
+ * @param[in,out] array  objects to free, set to 0 on return
+ * @param[in] n  number of objects in array
+ *
+ * Usage:
+ * @code
+ * obj_t obj[42];
+ * NEWOBJ_BATCH(obj,42);
+ * // ...
+ * FREEOBJ_BATCH(obj,42);
+ * @endcode
+ */
+#define FREEOBJ_BATCH(array,n) \
+  cclass_free_batch((void **)(array),n)
+
+/**
+ * @def INTERN(dest,source)
+ * @brief Intern a string
+ *
+ * Call the USE_XASSERT macro at the top of the source file.
+ *
+ * @param[in] dest  shared copy of the string
+ * @param[in] source  string to intern
+ *
+ * Usage:
+ * @code
+ * const char *key;
+ * INTERN(key, "some key");
+ * // ...
+ * UNINTERN(key);
+ * @endcode
+ */
+#define INTERN(dest, source) \
+  (dest = cclass_intern(source,SRCFILE,__LINE__))
+
 /**
  * @def ISPOWER2(x)
  * @brief Test if a number is a power of two
@@ -85,6 +202,27 @@ __BEGIN_DECLS
 #define MALLOC(size) \
   cclass_malloc(size,NULL,SRCFILE,__LINE__)
 
+/**
+ * @def MALLOC_NEAR(size,hint)
+ * @brief MALLOC utility macro, placing the memory near another object
+ *
+ * @param[in] size  number of bytes to allocate
+ * @param[in] hint  heap object to place the memory near (or 0)
+ *
+ * Usage:
+ * @code
+ * char *buffer;
+ * buffer = MALLOC_NEAR(42, obj); // on obj's page where possible
+ * // ...
+ * FREEOBJ(buffer);
+ * @endcode
+ *
+ * @return a pointer to allocated memory or NULL if the allocation
+ * failed
+ */
+#define MALLOC_NEAR(size,hint) \
+  cclass_malloc_near(size,NULL,hint,SRCFILE,__LINE__)
+
 /**
  * @def NEWARRAY(array,size)
  * @brief Allocate memory to contain N (size) array elements
@@ -109,6 +247,9 @@ __BEGIN_DECLS
  * @def NEWOBJ(obj)
  * @brief Allocate memory for an object
  *
+ * The object is zeroed, or if its class has an init hook, initialised
+ * by the hook instead.
+ *
  * @param[in] obj  object to allocate
  *
  * Usage:
@@ -122,6 +263,91 @@ __BEGIN_DECLS
 #define NEWOBJ(obj) \
   (obj = cclass_malloc(sizeof(*obj),&_CD(obj),SRCFILE,__LINE__))
 
+/**
+ * @def NEWOBJ_BATCH(array,n)
+ * @brief Allocate memory for an array of objects
+ *
+ * All objects are allocated in one go, and each one passes VERIFY()
+ * on its own.  The array variable must be named after the object, as
+ * for NEWOBJ().
+ *
+ * @param[out] array  objects to allocate
+ * @param[in] n  number of objects to allocate
+ *
+ * @return array, or 0 if the allocation failed
+ *
+ * Usage:
+ * @code
+ * obj_t obj[42];
+ * NEWOBJ_BATCH(obj,42);
+ * // ...
+ * FREEOBJ_BATCH(obj,42);
+ * @endcode
+ */
+#define NEWOBJ_BATCH(array,n) \
+  cclass_malloc_batch(n,sizeof(**(array)),&_CD(array),(void **)(array),\
+    SRCFILE,__LINE__)
+
+/**
+ * @def NEWOBJ_CHILD(obj,parent)
+ * @brief Allocate memory for an object owned by another
+ *
+ * As NEWOBJ(), but the object is owned by parent: freeing the parent
+ * frees the object too, after calling its fini hook.  The object is
+ * placed close to its parent when possible.
+ *
+ * @param[in] obj  object to allocate
+ * @param[in] parent  owning heap object
+ *
+ * Usage:
+ * @code
+ * root_t root;
+ * leaf_t leaf;
+ * NEWOBJ(root);
+ * NEWOBJ_CHILD(leaf,root);
+ * // ...
+ * FREEOBJ(root); // frees leaf too
+ * @endcode
+ */
+#define NEWOBJ_CHILD(obj,parent) \
+  (obj = cclass_malloc_child(sizeof(*obj),&_CD(obj),parent,SRCFILE,__LINE__))
+
+/**
+ * @def NEWOBJ_NEAR(obj,hint)
+ * @brief Allocate memory for an object accessed along with another
+ *
+ * As NEWOBJ(), but the object is placed in the same or an adjacent page
+ * as hint when possible.  The object is freed and verified on its own.
+ *
+ * @param[in] obj  object to allocate
+ * @param[in] hint  heap object to place obj near (or 0)
+ *
+ * Usage:
+ * @code
+ * node_t node;
+ * edge_t edge;
+ * NEWOBJ(node);
+ * NEWOBJ_NEAR(edge,node);
+ * @endcode
+ */
+#define NEWOBJ_NEAR(obj,hint) \
+  (obj = cclass_malloc_near(sizeof(*obj),&_CD(obj),hint,SRCFILE,__LINE__))
+
+/**
+ * @def NEWOBJ_HANDLE(obj,handle)
+ * @brief Allocate memory for an object, and a handle to it
+ *
+ * As NEWOBJ(), and set handle to a handle of the new object, or to 0
+ * if the allocation failed.
+ *
+ * @param[in] obj  object to allocate
+ * @param[out] handle  cclass_handle to set
+ *
+ * Usage: see VERIFY_HANDLE()
+ */
+#define NEWOBJ_HANDLE(obj,handle) \
+  (handle = (NEWOBJ(obj) ? cclass_handle_of(obj) : 0))
+
 /**
  * @brief Allocates memory for a string of size - 1 bytes
  *
@@ -141,6 +367,24 @@ __BEGIN_DECLS
 #define NEWSTRING(dest, size) \
   (dest = MALLOC((size_t)(size)))
 
+/**
+ * @def NEWSTRING_CHILD(dest,size,parent)
+ * @brief Allocates memory for a string owned by another object
+ *
+ * As NEWSTRING(), with ownership as for NEWOBJ_CHILD().
+ *
+ * @param[in] dest  new string
+ * @param[in] size  number of bytes to allocate
+ * @param[in] parent  owning heap object
+ *
+ * Usage:
+ * @code
+ * NEWSTRING_CHILD(obj->name,42,obj); // freed with obj
+ * @endcode
+ */
+#define NEWSTRING_CHILD(dest,size,parent) \
+  (dest = cclass_malloc_child((size_t)(size),NULL,parent,SRCFILE,__LINE__))
+
 /**
  * @def NUMSTATICELS(array)
  * @brief Number of static elements in an array
@@ -200,11 +444,27 @@ __BEGIN_DECLS
 #define STRDUP(dest, source) \
   (dest = cclass_strdup(source,SRCFILE,__LINE__))
 
+/**
+ * @def UNINTERN(s)
+ * @brief Release an interned string
+ *
+ * @param[in,out] s  interned string (or 0), set to 0
+ *
+ * Usage: see INTERN()
+ */
+#define UNINTERN(s) (s = cclass_unintern(s))
+
 /**
  * @brief Memory Free
  *
  * Free a block of memory that was previously allocated through
- * cclass_malloc().
+ * cclass_malloc().  The fini hook of the class descriptor, if any, is
+ * called on the block first.  Objects owned by the block are freed
+ * along with it, depth first, each after its own fini hook.  When
+ * cclass_retain() gave the block other holders, only the caller's
+ * reference is dropped, as by cclass_release(); an owned object with
+ * other holders likewise loses only its owner's reference, and is left
+ * without an owner.
  *
  * @param[in] p  heap pointer to free or 0
  *
@@ -219,15 +479,321 @@ __BEGIN_DECLS
  */
 void *cclass_free(void *p);
 
+/**
+ * @brief Memory free of several objects
+ *
+ * Free n blocks of memory that were previously allocated through
+ * cclass_malloc() or cclass_malloc_batch().  Blocks from one batch
+ * are returned to the system when the last of them is freed.  Objects
+ * with a fini hook or owned objects are freed as by cclass_free();
+ * the others are released together, once per slab or arena run.
+ *
+ * @param[in,out] mem  heap pointers to free (or 0), set to 0 on return
+ * @param[in] n  number of heap pointers
+ *
+ * Usage: see FREEOBJ_BATCH()
+ */
+void cclass_free_batch(void **mem,
+		       size_t n);
+
 /** Class descriptor */
 typedef struct classdesc_tag {
 	char *name; /**< class name tag */
+	unsigned flags; /**< CCLASS_* allocation flags */
+	/** object initialiser called on allocation, instead of zeroing */
+	void (*init)(void *obj);
+	/** object finaliser called before the object is freed */
+	void (*fini)(void *obj);
+	void **objects; /**< live objects of the class, kept by the heap */
+	size_t count; /**< number of live objects of the class */
+	size_t capacity; /**< number of entries allocated in objects */
+	size_t budget; /**< limit on live bytes of the class, or 0 */
+	size_t soft_limit; /**< live bytes that trigger pressure, or 0 */
+	/** called when soft_limit is crossed or budget is reached */
+	void (*pressure)(struct classdesc_tag *desc, size_t bytes);
+	size_t bytes; /**< live bytes of the class, kept by the heap */
+	unsigned metrics; /**< shared metrics slot, kept by the heap */
+	unsigned trace; /**< trace the class was named in, kept by the heap */
+	/** latency histograms of the class, kept by the heap */
+	struct cclass_histograms_tag *latency;
+	size_t peak; /**< most live objects of the class, kept by the heap */
+	size_t peak_bytes; /**< most live bytes of the class, kept by the heap */
 } classdesc;
 
+/**
+ * @brief Handle of a heap object
+ *
+ * A slot in the handle table in the low 32 bits, and the generation of
+ * the slot in the high 32 bits.  0 is never a valid handle.
+ */
+typedef uint64_t cclass_handle;
+
+/**
+ * @brief Object of a handle
+ *
+ * Look the handle up in the handle table.  Only the table is read, so
+ * any handle may be passed: a handle of a freed object, or of an object
+ * of another class, gives 0.
+ *
+ * @param[in] handle  handle to look up
+ * @param[in] desc  class descriptor the object must have, or 0 for any
+ *
+ * @return the object, or 0 if the handle is stale or of another class
+ *
+ * Usage: see VERIFY_HANDLE()
+ */
+void *cclass_handle_object(cclass_handle handle,
+			   classdesc *desc);
+
+/**
+ * @brief Handle of a heap object
+ *
+ * Give the object a slot in the handle table, unless it has one.  The
+ * handle turns stale when the object is freed.
+ *
+ * @param[in] p  heap object
+ *
+ * @return the handle of p, or 0 if p is not a heap object or the table
+ * could not grow
+ */
+cclass_handle cclass_handle_of(void *p);
+
+/**
+ * @brief Tail of the header in front of every heap object
+ *
+ * The last members of the heap's own object header, right before the
+ * object.  VERIFY() reads them to match a live object against its
+ * class.
+ */
+typedef struct cclass_header_tag {
+	unsigned index; /**< private to the heap */
+	unsigned refs; /**< references, 0 once released */
+	void *mem; /**< address of the object itself */
+	classdesc *desc; /**< class descriptor of the object or 0 */
+} cclass_header;
+
+/**
+ * @brief Reserve room for objects of a class
+ *
+ * Make room for another n objects of a class, so that the first
+ * allocations after startup cost no more than later ones.  The class's
+ * object list and the block registry are grown, and for objects served
+ * from the huge page arena (see cclass_set_hugepage()), blocks are
+ * carved and their pages faulted in.  Objects served by the backend
+ * get their memory from the backend on allocation.
+ *
+ * @param[in] desc  class descriptor
+ * @param[in] n  number of objects
+ * @param[in] size  size of an object
+ *
+ * @return true if room was made for all n objects
+ *
+ * Usage:
+ * @code
+ * cclass_class_reserve(&obj_classdesc, 1000000, sizeof(*obj));
+ * @endcode
+ */
+bool cclass_class_reserve(classdesc *desc,
+			  size_t n,
+			  size_t size);
+
+/**
+ * @brief Iterate over the live objects of a class
+ *
+ * Call a function for every live object of a class.  The cost depends
+ * on the number of objects of the class only, not on the heap size.
+ * Objects are visited from newest slot to oldest, so the function may
+ * free the object it is called for, but no other objects of the class.
+ *
+ * @param[in] desc  class descriptor
+ * @param[in] func  function to call as func(object, arg)
+ * @param[in] arg  argument passed to func
+ *
+ * @return number of objects visited
+ *
+ * Usage: see FOREACHOBJ()
+ */
+size_t cclass_class_foreach(classdesc *desc,
+			    void (*func)(void *obj, void *arg),
+			    void *arg);
+
+/** Huge page arena statistics */
+typedef struct cclass_arena_info_tag {
+	size_t regions; /**< number of 2 MiB regions mapped */
+	size_t mapped; /**< bytes mapped for regions */
+	size_t used; /**< bytes in blocks handed out to live objects */
+	size_t hugetlb; /**< bytes mapped from reserved (MAP_HUGETLB) pages */
+	size_t hugepage; /**< bytes advised as MADV_HUGEPAGE */
+	size_t backed; /**< bytes actually backed by huge pages */
+} cclass_arena_info;
+
+/**
+ * @brief Huge page arena statistics
+ *
+ * Gather statistics on the huge page arena.  The number of bytes backed
+ * by transparent huge pages is read from /proc/self/smaps, and depends
+ * on the kernel (see /sys/kernel/mm/transparent_hugepage/enabled).
+ *
+ * @param[out] info  where to place the statistics
+ */
+void cclass_arena_stats(cclass_arena_info *info);
+
+/**
+ * @brief Allocation stack of heap object
+ *
+ * Copy the return addresses recorded when the object was allocated,
+ * innermost first, if its stack was captured (see
+ * cclass_set_backtrace()).  The stack starts at the caller of the
+ * library: frames inside a shared libcclass are left out.  Objects
+ * allocated by the same code path share one stored stack.
+ *
+ * @param[in] p  heap object
+ * @param[out] frame  where to place the return addresses
+ * @param[in] n  room in frame
+ *
+ * @return number of return addresses placed, 0 if none were captured
+ *
+ * Usage:
+ * @code
+ * void *frame[16];
+ * size_t n = cclass_backtrace(obj, frame, 16);
+ * backtrace_symbols_fd(frame, n, STDERR_FILENO);
+ * @endcode
+ */
+size_t cclass_backtrace(void *p,
+			void **frame,
+			size_t n);
+
+/** Backend allocator used for heap object memory */
+typedef struct cclass_backend_tag {
+	void *(*malloc)(size_t size); /**< allocate memory */
+	void *(*realloc)(void *p, size_t size); /**< resize memory */
+	void (*free)(void *p); /**< release memory */
+	/** usable size of memory, like malloc_usable_size(), or 0 */
+	size_t (*usable_size)(void *p);
+} cclass_backend;
+
+/** Heap statistics */
+typedef struct cclass_stats_tag {
+	size_t blocks; /**< number of live heap objects */
+	size_t bytes; /**< aligned payload bytes of live heap objects */
+	size_t charged; /**< bytes charged against the global budget */
+} cclass_stats;
+
+/**
+ * @brief Heap statistics
+ *
+ * Gather statistics on all live heap objects.  The block registry is
+ * scanned sequentially, without touching the objects themselves.
+ *
+ * @param[out] stats  where to place the statistics
+ *
+ * Usage:
+ * @code
+ * cclass_stats stats;
+ * cclass_heap_stats(&stats);
+ * printf("%zu blocks\n", stats.blocks);
+ * @endcode
+ */
+void cclass_heap_stats(cclass_stats *stats);
+
+/**
+ * @brief Intern a string
+ *
+ * Return the shared, immutable copy of a string, making one on first
+ * use.  Each call takes a reference, to be released with
+ * cclass_unintern(); the copy is freed with its last reference.
+ * Copies are heap objects of class "intern", tracked like any other.
+ * Interning is not thread safe: like any other heap call, interning
+ * and releasing strings needs the caller's heap lock in a threaded
+ * program.
+ *
+ * @param[in] s  string to intern (or 0)
+ * @param[in] file  filename where string is being interned
+ * @param[in] line  line number where string is being interned
+ *
+ * @return the shared copy of the string or 0
+ *
+ * Usage: see INTERN()
+ */
+const char *cclass_intern(const char *s,
+			  const char *file,
+			  int line);
+
+/** Interned string statistics */
+typedef struct cclass_intern_info_tag {
+	size_t strings; /**< number of distinct interned strings */
+	size_t bytes; /**< bytes of interned strings, with terminators */
+	size_t lookups; /**< number of cclass_intern() calls */
+	size_t hits; /**< calls that found the string already interned */
+} cclass_intern_info;
+
+/**
+ * @brief Interned string statistics
+ *
+ * The hit rate is hits / lookups; each hit saved an allocation.
+ *
+ * @param[out] info  where to place the statistics
+ */
+void cclass_intern_stats(cclass_intern_info *info);
+
+/** Timed heap operations */
+typedef enum cclass_latency_op_tag {
+	CCLASS_LATENCY_MALLOC, /**< cclass_malloc() */
+	CCLASS_LATENCY_REALLOC, /**< cclass_realloc() */
+	CCLASS_LATENCY_FREE, /**< cclass_free() */
+	CCLASS_LATENCY_OPS /**< number of timed operations */
+} cclass_latency_op;
+
+/** Latency percentiles of a heap operation, in nanoseconds */
+typedef struct cclass_latency_info_tag {
+	size_t count; /**< number of timed calls */
+	unsigned long p50; /**< median */
+	unsigned long p99; /**< 99th percentile */
+	unsigned long p999; /**< 99.9th percentile */
+	unsigned long max; /**< slowest call */
+} cclass_latency_info;
+
+/**
+ * @brief Latency of a heap operation
+ *
+ * Read the latency percentiles of an operation on objects of a class,
+ * or on all objects, from the histograms kept while timing is enabled
+ * (see cclass_set_latency()).  Percentiles are bucket upper bounds,
+ * within 1/8 of the true value.
+ *
+ * @param[in] desc  class descriptor, or 0 for all objects
+ * @param[in] op  heap operation
+ * @param[out] info  where to place the percentiles
+ *
+ * @return true if calls were timed
+ *
+ * Usage:
+ * @code
+ * cclass_latency_info info;
+ * if (cclass_latency(&obj_classdesc, CCLASS_LATENCY_MALLOC, &info)) {
+ *     printf("p99 %lu ns\n", info.p99);
+ * }
+ * @endcode
+ */
+bool cclass_latency(classdesc *desc,
+		    cclass_latency_op op,
+		    cclass_latency_info *info);
+
+/**
+ * @brief Latency report
+ *
+ * Display the latency percentiles of all timed operations, per class
+ * and per allocation site.
+ */
+void cclass_latency_report(void);
+
 /**
  * @brief Memory new
  *
- * Allocate a new block of memory from the heap.
+ * Allocate a new block of memory from the heap.  The block is zeroed,
+ * unless the class descriptor has an init hook, which is called on the
+ * block instead.  Memory from the huge page arena is always zeroed.
  *
  * @param[in] size  size of object to allocate
  * @param[in] desc  class descriptor for object (or 0)
@@ -243,6 +809,247 @@ void *cclass_malloc(size_t size,
 		    const char *file,
 		    int line);
 
+/**
+ * @brief Memory new for several objects
+ *
+ * Allocate n new blocks of memory of the same size and class from the
+ * heap, using a single allocation and block registry update.  Each
+ * block may be verified, reallocated and freed on its own.
+ *
+ * @param[in] n  number of objects to allocate
+ * @param[in] size  size of each object
+ * @param[in] desc  class descriptor for objects (or 0)
+ * @param[out] mem  where to place the n memory object pointers
+ * @param[in] file  filename where objects were allocated
+ * @param[in] line  line number where objects were allocated
+ *
+ * @return mem, or 0 if the allocation failed
+ *
+ * Usage: see NEWOBJ_BATCH()
+ */
+void **cclass_malloc_batch(size_t n,
+			   size_t size,
+			   classdesc *desc,
+			   void **mem,
+			   const char *file,
+			   int line);
+
+/**
+ * @brief Memory new owned by another object
+ *
+ * Allocate a new block of memory as cclass_malloc() does, owned by
+ * parent.  When parent is freed, the block is freed as well.  The block
+ * is placed near parent, as by cclass_malloc_near().
+ *
+ * @param[in] size  size of object to allocate
+ * @param[in] desc  class descriptor for object (or 0)
+ * @param[in] parent  owning heap object
+ * @param[in] file  filename where object was allocated
+ * @param[in] line  line number where object was allocated
+ *
+ * @return a pointer to the memory object or 0
+ *
+ * Usage: see NEWOBJ_CHILD()
+ */
+void *cclass_malloc_child(size_t size,
+			  classdesc *desc,
+			  void *parent,
+			  const char *file,
+			  int line);
+
+/**
+ * @brief Memory new placed near another object
+ *
+ * Allocate a new block of memory as cclass_malloc() does, close to
+ * hint: in the same or an adjacent page where the huge page region of
+ * hint has a block free there, or else anywhere in that region.
+ * Placement applies to hints served from the huge page arena (see
+ * cclass_set_hugepage()); others are ignored.
+ *
+ * @param[in] size  size of object to allocate
+ * @param[in] desc  class descriptor for object (or 0)
+ * @param[in] hint  heap object to place the block near (or 0)
+ * @param[in] file  filename where object was allocated
+ * @param[in] line  line number where object was allocated
+ *
+ * @return a pointer to the memory object or 0
+ *
+ * Usage: see NEWOBJ_NEAR()
+ */
+void *cclass_malloc_near(size_t size,
+			 classdesc *desc,
+			 void *hint,
+			 const char *file,
+			 int line);
+
+/** Memory overhead of heap objects */
+typedef struct cclass_overhead_tag {
+	size_t blocks; /**< number of live heap objects */
+	size_t payload; /**< bytes requested */
+	size_t rounding; /**< bytes added by alignment of sizes */
+	size_t headers; /**< prefix and postfix bytes */
+	size_t slack; /**< block bytes beyond headers and object */
+	size_t registry; /**< bookkeeping bytes outside the blocks */
+	size_t arena_free; /**< arena bytes not in live blocks, overall only */
+	/** share of all the above bytes that is not payload */
+	double fragmentation;
+} cclass_overhead;
+
+/**
+ * @brief Memory overhead
+ *
+ * Account for the bytes held for live heap objects of a class, or of
+ * the whole heap, beyond the bytes requested.  Slack is the part of a
+ * block beyond its headers and object: the size class rounding of the
+ * arena, the padding of a batch slab, or what the backend reports
+ * usable beyond the request.  The registry is scanned sequentially;
+ * backend slack is read from the blocks.
+ *
+ * @param[in] desc  class descriptor, or 0 for the whole heap
+ * @param[out] info  where to place the accounting
+ *
+ * Usage:
+ * @code
+ * cclass_overhead info;
+ * cclass_overhead_stats(&obj_classdesc, &info);
+ * printf("%.1f%% overhead\n", 100 * info.fragmentation);
+ * @endcode
+ */
+void cclass_overhead_stats(classdesc *desc,
+			   cclass_overhead *info);
+
+/**
+ * @brief Memory overhead report
+ *
+ * Display the memory overhead of each class with live objects, of
+ * objects without a class, and of the whole heap.
+ */
+void cclass_overhead_report(void);
+
+/**
+ * @brief Owner of heap object
+ *
+ * @param[in] p  heap object
+ *
+ * @return the object owning p, or 0 if p has no owner
+ *
+ * Usage:
+ * @code
+ * NEWOBJ_CHILD(leaf,root);
+ * assert(cclass_parent(leaf) == root);
+ * @endcode
+ */
+void *cclass_parent(void *p);
+
+/**
+ * @brief Close the persistent or shared heap
+ *
+ * Write the heap back to its file and unmap it.  Its objects are
+ * forgotten by this process, but stay in the file.
+ */
+void cclass_persist_close(void);
+
+/**
+ * @brief Open a persistent heap
+ *
+ * Map a heap file shared at a fixed base address.  From then on,
+ * objects of the given classes are allocated in the file; objects over
+ * 64 KiB cannot be.  A new file is created with size bytes.  An
+ * existing file is checked block by block first, and its objects are
+ * registered with the heap, with their classes bound by name to the
+ * given ones, so that they can be verified, walked and freed at once.
+ * Pointers between them stay valid, as the base address is the same.
+ *
+ * A file that fails the check, for instance after a crash during an
+ * allocation, is refused and left untouched.  Ownership links, budgets
+ * and allocation sites are not kept in the file.
+ *
+ * @param[in] path  heap file
+ * @param[in] base  address to map the file at
+ * @param[in] size  bytes in a new file, at least 4 KiB plus 2 MiB
+ * @param[in] classes  classes of the objects in the file
+ * @param[in] n  number of classes, at most 64
+ *
+ * @return true if the heap was opened
+ *
+ * Usage:
+ * @code
+ * classdesc *classes[] = { &_CD(entry) };
+ * if (cclass_persist_open("cache.heap", (void *) 0x600000000000,
+ *                         1 << 30, classes, 1)) {
+ *     cache = cclass_persist_root();
+ *     // ...
+ *     cclass_persist_set_root(cache);
+ *     cclass_persist_close();
+ * }
+ * @endcode
+ */
+bool cclass_persist_open(const char *path,
+			 void *base,
+			 size_t size,
+			 classdesc **classes,
+			 size_t n);
+
+/**
+ * @brief Root object of the persistent or shared heap
+ *
+ * @return object set by cclass_persist_set_root(), or 0
+ */
+void *cclass_persist_root(void);
+
+/**
+ * @brief Set the root object of the persistent or shared heap
+ *
+ * The root is where a later process finds its way into the objects of
+ * the heap.
+ *
+ * @param[in] root  persistent object or 0
+ */
+void cclass_persist_set_root(void *root);
+
+/**
+ * @brief Write the persistent heap to its file
+ *
+ * @return true if the heap is open and was written
+ */
+bool cclass_persist_sync(void);
+
+/**
+ * @brief Pre-size classes from the peaks of an earlier run
+ *
+ * Reserve room for the peak number of live objects each class reached
+ * in the run that wrote the profile, as cclass_class_reserve() with
+ * their average size.  The profile is rewritten with the peaks of this
+ * run at exit, or by cclass_profile_save().  Classes are matched by
+ * name.  Call at startup, before the classes are used.
+ *
+ * @param[in] path  profile file, missing on the first run, or 0 to
+ * stop writing the profile
+ * @param[in] classes  descriptors of the classes to profile
+ * @param[in] n  number of descriptors in classes
+ *
+ * @return true if the profile was read and all room was reserved
+ *
+ * Usage:
+ * @code
+ * classdesc *classes[] = { &session_classdesc, &message_classdesc };
+ * cclass_profile_load("/var/lib/server/cclass.profile", classes, 2);
+ * @endcode
+ */
+bool cclass_profile_load(const char *path,
+			 classdesc **classes,
+			 size_t n);
+
+/**
+ * @brief Write the peaks of this run to the profile
+ *
+ * The profile file is replaced whole.
+ *
+ * @return true if the profile was written, false if no profile was
+ * loaded or it could not be written
+ */
+bool cclass_profile_save(void);
+
 /**
  * @brief Memory realloc
  *
@@ -262,6 +1069,206 @@ void *cclass_realloc(void *p,
 		     const char *file,
 		     int line);
 
+/**
+ * @brief Release a reference to a heap object
+ *
+ * Drop a reference taken by cclass_retain(), or the one held since
+ * allocation.  The count is updated atomically; the last release frees
+ * the object, as cclass_free().  Releasing an object without references
+ * left is reported as an error.  As it may free, a release is a heap
+ * call like any other: a threaded program makes it under its heap lock,
+ * or hands the object back to the heap's thread to release.
+ *
+ * @param[in] p  heap object to release
+ *
+ * @return 0
+ *
+ * Usage: see RELEASEOBJ()
+ */
+void *cclass_release(void *p);
+
+/**
+ * @brief Take a reference to a heap object
+ *
+ * Every heap object starts with one reference, held by its creator.
+ * Sharing an object by reference, rather than copying it, keeps it
+ * alive until every holder released it.  The count is updated
+ * atomically, so references may be taken in any thread, without the
+ * heap lock.
+ *
+ * @param[in] p  heap object to retain
+ *
+ * @return p, or 0 if p is not a live heap object
+ *
+ * Usage: see RELEASEOBJ()
+ */
+void *cclass_retain(void *p);
+
+/**
+ * @brief Set backend allocator
+ *
+ * Select the allocator that provides memory for heap objects.  The
+ * heap must be empty, as objects are released by the backend that
+ * allocated them.  Usually called once at startup.
+ *
+ * @param[in] backend  backend allocator, or 0 for the C library
+ *
+ * @return the previous backend, or 0 if the heap is not empty
+ *
+ * Usage:
+ * @code
+ * static const cclass_backend my_backend = {
+ *     .malloc = my_malloc,
+ *     .realloc = my_realloc,
+ *     .free = my_free,
+ * };
+ * cclass_set_backend(&my_backend);
+ * @endcode
+ */
+const cclass_backend *cclass_set_backend(const cclass_backend *backend);
+
+/**
+ * @brief Capture allocation stacks
+ *
+ * Record the callers of one allocation in every period, so that leaks
+ * can be traced past generic create functions to the code path that
+ * allocated them.  Each distinct stack is stored once, and shown by id
+ * in cclass_walk_heap() and in full by cclass_stack_report().  A
+ * capture costs an unwind of the stack, which a period of a few
+ * thousand makes cheap enough for production.  Disabled capture costs
+ * a single test per allocation.
+ *
+ * @param[in] depth  frames to record, up to 32, or 0 to stop
+ * @param[in] period  allocations per capture, 0 or 1 for all
+ *
+ * Usage:
+ * @code
+ * cclass_set_backtrace(16, 1000);
+ * // ...
+ * cclass_stack_report();
+ * @endcode
+ */
+void cclass_set_backtrace(unsigned depth,
+			  unsigned period);
+
+/**
+ * @brief Set global memory budget
+ *
+ * Limit the live bytes of all heap objects, headers included.  Class
+ * descriptors have their own budget, soft_limit and pressure fields for
+ * limits per class.  The pressure function is called (with a 0 class
+ * descriptor for the global budget) when the soft limit is crossed, so
+ * that caches can shed load.  When an allocation would exceed a budget
+ * it is called once more, and if that does not free enough memory the
+ * allocation is refused and returns 0.  Objects of CCLASS_CRITICAL
+ * classes are never refused.  Growth by cclass_realloc() gets no second
+ * chance: the function is only called once the realloc has finished,
+ * so it may free the object itself.
+ *
+ * @param[in] limit  budget in bytes, or 0 for no limit
+ * @param[in] soft_limit  pressure limit in bytes, or 0 for none
+ * @param[in] pressure  pressure function or 0
+ *
+ * Usage:
+ * @code
+ * static void shed(classdesc *desc, size_t bytes) { ... }
+ * // ...
+ * cclass_set_budget(1 << 30, 3 << 28, shed);
+ * @endcode
+ */
+void cclass_set_budget(size_t limit,
+		       size_t soft_limit,
+		       void (*pressure)(classdesc *desc, size_t bytes));
+
+/**
+ * @brief Select huge page arena for all objects
+ *
+ * Serve all objects of up to 64 KiB from 2 MiB aligned regions backed
+ * by huge pages where available, instead of from the backend.  Objects
+ * of classes with the CCLASS_HUGEPAGE flag are always served from these
+ * regions.  Normal pages are used when huge pages are not available.
+ *
+ * @param[in] enable  true to select the arena, false for the backend
+ */
+void cclass_set_hugepage(bool enable);
+
+/**
+ * @brief Time heap operations
+ *
+ * Time cclass_malloc(), cclass_realloc() and cclass_free() with the
+ * processor's time stamp counter, and gather the times in log-linear
+ * histograms per class and per allocation site.  Disabled timing costs
+ * a single test per call.
+ *
+ * @param[in] enable  true to start timing, false to stop
+ */
+void cclass_set_latency(bool enable);
+
+/**
+ * @brief Set emergency reserve
+ *
+ * Map and populate at least the given number of bytes up front, in
+ * 2 MiB regions.  Objects of CCLASS_CRITICAL classes of up to 64 KiB
+ * are served from the reserve when the backend runs out of memory.
+ *
+ * @param[in] bytes  minimum size of the reserve
+ *
+ * @return size of the reserve in bytes
+ */
+size_t cclass_set_reserve(size_t bytes);
+
+/**
+ * @brief Open a shared heap
+ *
+ * Map a POSIX shared memory segment at a fixed base address, as a heap
+ * that several processes use at once.  From then on, objects of the
+ * given classes are allocated in the segment, under a lock in the
+ * segment.  The first process creates the segment with size bytes; the
+ * others map it as it is.  Each process registers only the objects it
+ * allocates.  Objects of other processes may be verified and read when
+ * the class descriptors are at the same addresses in all of them, as in
+ * processes forked from a common parent, but only the process that
+ * allocated an object can free it; cclass_free() of an object of
+ * another process is refused as an invalid pointer, and the objects of
+ * a process that exits stay in the segment.  A process that dies while
+ * holding the lock does not block the others.
+ *
+ * The segment stays until removed with shm_unlink().
+ *
+ * @param[in] name  shared memory segment name
+ * @param[in] base  address to map the segment at
+ * @param[in] size  bytes in a new segment, at least 4 KiB plus 2 MiB
+ * @param[in] classes  classes of the objects in the segment, in the
+ * same order in all processes
+ * @param[in] n  number of classes, at most 64
+ *
+ * @return true if the heap was opened
+ *
+ * Usage:
+ * @code
+ * classdesc *classes[] = { &_CD(entry) };
+ * cclass_shared_open("/tables", (void *) 0x600000000000, 1 << 30,
+ *                    classes, 1);
+ * // build tables, cclass_persist_set_root(table), then fork workers
+ * @endcode
+ */
+bool cclass_shared_open(const char *name,
+			void *base,
+			size_t size,
+			classdesc **classes,
+			size_t n);
+
+/**
+ * @brief Live objects by allocation stack
+ *
+ * Display the number of live objects and bytes allocated by each
+ * captured stack, with the stack's symbolized return addresses, and
+ * the objects allocated without a captured stack.
+ *
+ * Usage: see cclass_set_backtrace()
+ */
+void cclass_stack_report(void);
+
 /**
  * @brief Memory string duplicator
  *
@@ -288,6 +1295,105 @@ void *cclass_strdup(const char *s,
  */
 bool cclass_test_pointer(void *p);
 
+/**
+ * @brief Return idle arena memory to the kernel
+ *
+ * Trim the huge page arena regions that saw no allocation or free for
+ * the decay time, as measured between passes: regions without objects
+ * are unmapped, and of the others, the pages inside free blocks are
+ * released with MADV_DONTNEED.  Blocks reserved with
+ * cclass_class_reserve() and never used are trimmed too.  Allocation
+ * and free do no work for trimming; call this periodically, for
+ * instance when idle, or start a background trimmer with
+ * cclass_trim_start().
+ *
+ * @param[in] decay  idle time in milliseconds before a region is
+ * trimmed, 0 to trim all regions now
+ *
+ * @return number of bytes released by this pass
+ */
+size_t cclass_trim(unsigned decay);
+
+/**
+ * @brief Start background trimmer
+ *
+ * Run cclass_trim() on a thread of its own, four times per decay time.
+ * The heap is not thread safe, so each pass holds the lock that the
+ * application holds around its heap calls.
+ *
+ * @param[in] decay  idle time in milliseconds before a region is
+ * trimmed, at least 1
+ * @param[in] lock  heap lock of the application
+ *
+ * @return true if the trimmer was started, false if it runs already,
+ * decay is 0 or the thread could not be created
+ *
+ * Usage:
+ * @code
+ * static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+ * cclass_trim_start(10000, &heap_lock);
+ * // ...
+ * pthread_mutex_lock(&heap_lock);
+ * NEWOBJ(obj);
+ * pthread_mutex_unlock(&heap_lock);
+ * @endcode
+ */
+bool cclass_trim_start(unsigned decay,
+		       pthread_mutex_t *lock);
+
+/** Trimming statistics */
+typedef struct cclass_trim_info_tag {
+	size_t released; /**< bytes returned to the kernel by all passes */
+	size_t retained; /**< free arena bytes held after the last pass */
+	size_t passes; /**< number of trim passes */
+} cclass_trim_info;
+
+/**
+ * @brief Trimming statistics
+ *
+ * Safe to call without the heap lock while the background trimmer
+ * runs; each field is read atomically, but a pass may complete between
+ * fields.
+ *
+ * @param[out] info  statistics gathered by cclass_trim() passes
+ */
+void cclass_trim_stats(cclass_trim_info *info);
+
+/**
+ * @brief Stop background trimmer
+ *
+ * Wait for a running pass to finish.  Must not be called while holding
+ * the heap lock passed to cclass_trim_start().
+ */
+void cclass_trim_stop(void);
+
+/**
+ * @brief Release an interned string
+ *
+ * Drop a reference taken by cclass_intern(), freeing the shared copy
+ * with its last reference.
+ *
+ * @param[in] s  interned string (or 0)
+ *
+ * @return 0
+ *
+ * Usage: see INTERN()
+ */
+const char *cclass_unintern(const char *s);
+
+/**
+ * @brief Usable size of a heap object
+ *
+ * The object may use all bytes up to its postfix, which is at least the
+ * size asked for.  Unlike the other calls, a pointer that is not a live
+ * heap object is no error.
+ *
+ * @param[in] p  heap pointer
+ *
+ * @return usable bytes, or 0 if p is not a live heap object
+ */
+size_t cclass_usable_size(void *p);
+
 /**
  * @brief Walk heap
  *
@@ -0,0 +1,141 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Shared memory heap metrics declaration
+ *
+ * A process may publish its heap counters in a POSIX shared memory
+ * segment named "/cclass.PID", where tools such as cclass-top can read
+ * them while the process runs.  Counters are updated by the allocation
+ * paths with relaxed atomic operations; readers take no locks either.
+ */
+#ifndef ITL_CCLASS_METRICS_H
+#define ITL_CCLASS_METRICS_H
+
+#include <stdint.h> /* int64_t, uint32_t, uint64_t */
+#include <sys/cdefs.h>
+#include <sys/types.h> /* pid_t */
+
+__BEGIN_DECLS
+
+/**
+ * @def CCLASS_METRICS_MAGIC
+ * @brief Magic number at the start of a metrics segment
+ */
+#define CCLASS_METRICS_MAGIC 0x63636c73
+
+/**
+ * @def CCLASS_METRICS_VERSION
+ * @brief Version of the metrics segment layout
+ */
+#define CCLASS_METRICS_VERSION 1
+
+/**
+ * @def CCLASS_METRICS_CLASSES
+ * @brief Number of class slots, the last one counts all further classes
+ */
+#define CCLASS_METRICS_CLASSES 64
+
+/**
+ * @def CCLASS_METRICS_SITES
+ * @brief Number of site slots, the last one counts all further sites
+ */
+#define CCLASS_METRICS_SITES 256
+
+/**
+ * @def CCLASS_METRICS_NAME
+ * @brief Size of a class or file name in a metrics segment
+ */
+#define CCLASS_METRICS_NAME 48
+
+/**
+ * @def CCLASS_METRICS_PATH
+ * @brief printf() format of the shared memory segment name
+ *
+ * Usage:
+ * @code
+ * char name[32];
+ * snprintf(name, sizeof(name), CCLASS_METRICS_PATH, pid);
+ * int fd = shm_open(name, O_RDONLY, 0);
+ * @endcode
+ */
+#define CCLASS_METRICS_PATH "/cclass.%d"
+
+/** Heap counters */
+typedef struct cclass_counters_tag {
+	uint64_t allocs; /**< number of allocations */
+	uint64_t frees; /**< number of frees */
+	int64_t blocks; /**< number of live objects */
+	int64_t bytes; /**< aligned payload bytes of live objects */
+} cclass_counters;
+
+/** Counters of one class */
+typedef struct cclass_metrics_class_tag {
+	char name[CCLASS_METRICS_NAME]; /**< class name */
+	cclass_counters counters; /**< class counters */
+} cclass_metrics_class;
+
+/** Counters of one allocation site */
+typedef struct cclass_metrics_site_tag {
+	char file[CCLASS_METRICS_NAME]; /**< file name, without directory */
+	int64_t line; /**< line number */
+	cclass_counters counters; /**< site counters */
+} cclass_metrics_site;
+
+/** Layout of a metrics segment */
+typedef struct cclass_metrics_tag {
+	uint32_t magic; /**< CCLASS_METRICS_MAGIC */
+	uint32_t version; /**< CCLASS_METRICS_VERSION */
+	pid_t pid; /**< publishing process */
+	uint32_t classes; /**< class slots in use */
+	uint32_t sites; /**< site slots in use */
+	cclass_counters total; /**< counters of the whole heap */
+	/** counters per class, slot 0 counts objects without class */
+	cclass_metrics_class class[CCLASS_METRICS_CLASSES];
+	/** counters per site, slot 0 counts unknown sites */
+	cclass_metrics_site site[CCLASS_METRICS_SITES];
+} cclass_metrics;
+
+/**
+ * @brief Publish heap metrics
+ *
+ * Create the shared memory segment for this process and start updating
+ * it.  The counters start out with the objects already on the heap.
+ * The segment is removed at exit.
+ *
+ * @return the published metrics, or 0 if the segment could not be
+ * created
+ *
+ * Usage:
+ * @code
+ * cclass_metrics_publish();
+ * // run: cclass-top PID
+ * @endcode
+ */
+const cclass_metrics *cclass_metrics_publish(void);
+
+/**
+ * @brief Stop publishing heap metrics
+ *
+ * Stop updating the shared memory segment and remove it.
+ */
+void cclass_metrics_unpublish(void);
+
+__END_DECLS
+
+#endif /* ITL_CCLASS_METRICS_H */
@@ -0,0 +1,725 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Track the heap of unmodified programs
+ *
+ * Preload library interposing malloc(), calloc(), realloc(),
+ * reallocarray(), free(), strdup() and malloc_usable_size() of the C
+ * library, so that the heap of a program can be tracked without
+ * recompiling it:
+ * @code
+ * CCLASS_WALK=1 LD_PRELOAD=libcclass-preload.so program
+ * @endcode
+ *
+ * Objects are allocated with cclass_malloc() and friends.  The site of
+ * an object is its caller's return address, named "object+offset"
+ * where the address belongs to a loaded object.
+ *
+ * The cclass heap is not thread safe, so calls are serialised by one
+ * lock.  Memory the heap itself needs while it holds the lock, and
+ * aligned allocations, come straight from the C library; such foreign
+ * blocks are remembered in a pointer set so free(), realloc() and
+ * malloc_usable_size() can tell them from heap objects.
+ *
+ * Reports go to stderr, never into the program's own output.
+ *
+ * Environment:
+ * - CCLASS_WALK  walk the heap of live objects at exit
+ * - CCLASS_METRICS  publish heap metrics for cclass-top
+ */
+#define _GNU_SOURCE /* dladdr(), RTLD_NEXT */
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h> /* malloc_usable_size() */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "malloc.h"
+#include "metrics.h"
+
+/* C library allocator entry points */
+#ifndef DOXYGEN_SKIP
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *mem, size_t size);
+extern void __libc_free(void *mem);
+extern void *__libc_memalign(size_t alignment, size_t size);
+#endif /* DOXYGEN_SKIP */
+
+/*
+ * Lock state.  A thread holding the lock is busy; calls it makes while
+ * busy come from the heap (or the C library on its behalf) and are
+ * served by the C library.
+ */
+#ifndef DOXYGEN_SKIP
+#define PTR_HASH(p) (((uintptr_t) (p) >> 4) * 0x9e3779b97f4a7c15ull)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool busy __attribute__((tls_model("initial-exec")));
+static bool ready = false;
+
+static struct foreign_tag {
+	void **ptr;			/* open addressed pointers   */
+	size_t count;			/* number of pointers        */
+	size_t size;			/* power of two table size   */
+} foreign;
+
+static struct callers_tag {
+	const void **addr;		/* open addressed callers    */
+	const char **name;		/* site file name of caller  */
+	size_t count;			/* number of callers         */
+	size_t size;			/* power of two table size   */
+} callers;
+#endif /* DOXYGEN_SKIP */
+
+/* Local prototypes */
+
+/**
+ * @brief Enter the heap
+ *
+ * Take the lock, unless the calling thread already holds it.
+ *
+ * @return true if the lock was taken, false if the thread is busy
+ */
+static bool enter(void);
+
+/**
+ * @brief Leave the heap
+ */
+static void leave(void);
+
+/**
+ * @brief Remember a foreign block
+ *
+ * @param mem  block from the C library, or 0
+ *
+ * @return mem, or 0 if it could not be remembered
+ */
+static void *foreign_insert(void *mem);
+
+/**
+ * @brief Is a block foreign?
+ *
+ * @param mem  heap pointer
+ *
+ * @return true if mem is a foreign block
+ */
+static bool foreign_contains(void *mem);
+
+/**
+ * @brief Forget a foreign block
+ *
+ * @param mem  heap pointer
+ *
+ * @return true if mem was a foreign block
+ */
+static bool foreign_remove(void *mem);
+
+/**
+ * @brief Name the site of a caller
+ *
+ * @param addr  return address of the caller
+ *
+ * @return site file name, or 0 if unknown
+ */
+static const char *caller_name(const void *addr);
+
+/**
+ * @brief Allocate a foreign block
+ *
+ * @param alignment  alignment in bytes, or 0 for default
+ * @param size  size in bytes
+ *
+ * @return block, or 0
+ */
+static void *foreign_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief Usable size of a foreign block
+ *
+ * The C library exports malloc_usable_size() only, which is interposed
+ * here, so its own is looked up past this library.
+ *
+ * @param mem  block from the C library
+ *
+ * @return usable bytes
+ */
+static size_t libc_usable_size(void *mem);
+
+/**
+ * @brief Resize a heap object or foreign block
+ *
+ * @param old  heap pointer, or 0
+ * @param size  new size in bytes
+ * @param caller  return address of the caller
+ *
+ * @return resized block, or 0
+ */
+static void *resize(void *old, size_t size, const void *caller);
+
+/* C library as backend of the heap */
+#ifndef DOXYGEN_SKIP
+static const cclass_backend preload_backend = {
+	.malloc = __libc_malloc,
+	.realloc = __libc_realloc,
+	.free = __libc_free,
+	.usable_size = libc_usable_size,
+};
+#endif /* DOXYGEN_SKIP */
+
+bool
+enter(void)
+{
+	if (busy) {
+		return false;
+	}
+	pthread_mutex_lock(&lock);
+	busy = true;
+	if (!ready) {
+		XASSERT_INTERACTIVE = false;
+		XASSERT_STREAM = stderr;
+		ready = (cclass_set_backend(&preload_backend) != 0);
+	}
+
+	return true;
+}
+
+void
+leave(void)
+{
+	busy = false;
+	pthread_mutex_unlock(&lock);
+}
+
+void *
+foreign_insert(void *mem)
+{
+	size_t h;
+
+	if (!mem) {
+		return 0;
+	}
+
+	/* Grow table at half load */
+	if (2 * (foreign.count + 1) > foreign.size) {
+		size_t size = foreign.size ? 2 * foreign.size : 1024;
+		void **ptr = (void **) __libc_calloc(size, sizeof(void *));
+		if (!ptr) {
+			__libc_free(mem);
+			return 0;
+		}
+		for (size_t i = 0; i < foreign.size; i++) {
+			if (foreign.ptr[i]) {
+				h = PTR_HASH(foreign.ptr[i]) & (size - 1);
+				while (ptr[h]) {
+					h = (h + 1) & (size - 1);
+				}
+				ptr[h] = foreign.ptr[i];
+			}
+		}
+		__libc_free(foreign.ptr);
+		foreign.ptr = ptr;
+		foreign.size = size;
+	}
+
+	h = PTR_HASH(mem) & (foreign.size - 1);
+	while (foreign.ptr[h]) {
+		h = (h + 1) & (foreign.size - 1);
+	}
+	foreign.ptr[h] = mem;
+	foreign.count++;
+
+	return mem;
+}
+
+bool
+foreign_contains(void *mem)
+{
+	size_t h;
+
+	if (!mem || !foreign.count) {
+		return false;
+	}
+
+	h = PTR_HASH(mem) & (foreign.size - 1);
+	while (foreign.ptr[h] != mem) {
+		if (!foreign.ptr[h]) {
+			return false;
+		}
+		h = (h + 1) & (foreign.size - 1);
+	}
+
+	return true;
+}
+
+bool
+foreign_remove(void *mem)
+{
+	size_t h;
+
+	if (!mem || !foreign.count) {
+		return false;
+	}
+
+	h = PTR_HASH(mem) & (foreign.size - 1);
+	while (foreign.ptr[h] != mem) {
+		if (!foreign.ptr[h]) {
+			return false;
+		}
+		h = (h + 1) & (foreign.size - 1);
+	}
+
+	/* Shift later entries of the probe run back into the hole */
+	for (size_t next = (h + 1) & (foreign.size - 1); foreign.ptr[next];
+	     next = (next + 1) & (foreign.size - 1)) {
+		size_t home = PTR_HASH(foreign.ptr[next]) & (foreign.size - 1);
+		if (((next - home) & (foreign.size - 1)) >=
+		    ((next - h) & (foreign.size - 1))) {
+			foreign.ptr[h] = foreign.ptr[next];
+			h = next;
+		}
+	}
+	foreign.ptr[h] = 0;
+	foreign.count--;
+
+	return true;
+}
+
+const char *
+caller_name(const void *addr)
+{
+	size_t h;
+
+	/* Grow tables at half load */
+	if (2 * (callers.count + 1) > callers.size) {
+		size_t size = callers.size ? 2 * callers.size : 1024;
+		const void **table = (const void **)
+		    __libc_calloc(size, sizeof(void *));
+		const char **name = (const char **)
+		    __libc_calloc(size, sizeof(char *));
+		if (!table || !name) {
+			__libc_free(table);
+			__libc_free(name);
+			return 0;
+		}
+		for (size_t i = 0; i < callers.size; i++) {
+			if (callers.addr[i]) {
+				h = PTR_HASH(callers.addr[i]) & (size - 1);
+				while (table[h]) {
+					h = (h + 1) & (size - 1);
+				}
+				table[h] = callers.addr[i];
+				name[h] = callers.name[i];
+			}
+		}
+		__libc_free(callers.addr);
+		__libc_free(callers.name);
+		callers.addr = table;
+		callers.name = name;
+		callers.size = size;
+	}
+
+	/* Probe for caller, naming it when not found */
+	h = PTR_HASH(addr) & (callers.size - 1);
+	while (callers.addr[h]) {
+		if (callers.addr[h] == addr) {
+			return callers.name[h];
+		}
+		h = (h + 1) & (callers.size - 1);
+	}
+	{
+		Dl_info info;
+		char name[CCLASS_METRICS_NAME];
+		if (dladdr(addr, &info) && info.dli_fname &&
+		    info.dli_fname[0]) {
+			const char *base = strrchr(info.dli_fname, '/');
+			snprintf(name, sizeof(name), "%s+%#lx",
+				 (base ? base + 1 : info.dli_fname),
+				 (unsigned long) ((const char *) addr -
+						  (const char *) info.dli_fbase));
+		} else {
+			snprintf(name, sizeof(name), "%p", addr);
+		}
+		callers.name[h] = (char *) __libc_malloc(strlen(name) + 1);
+		if (!callers.name[h]) {
+			return 0;
+		}
+		strcpy((char *) callers.name[h], name);
+	}
+	callers.addr[h] = addr;
+	callers.count++;
+
+	return callers.name[h];
+}
+
+void *
+foreign_alloc(size_t alignment, size_t size)
+{
+	void *mem;
+
+	if (enter()) {
+		mem = (alignment ? __libc_memalign(alignment, size) :
+		       __libc_malloc(size));
+		mem = foreign_insert(mem);
+		leave();
+	} else {
+		mem = (alignment ? __libc_memalign(alignment, size) :
+		       __libc_malloc(size));
+		mem = foreign_insert(mem);
+	}
+
+	return mem;
+}
+
+size_t
+libc_usable_size(void *mem)
+{
+	static size_t (*next)(void *) = 0;
+
+	if (!next) {
+		next = (size_t (*)(void *)) dlsym(RTLD_NEXT,
+						  "malloc_usable_size");
+	}
+
+	return (next ? next(mem) : 0);
+}
+
+void *
+resize(void *old, size_t size, const void *caller)
+{
+	bool entered;
+	void *mem;
+
+	if (old && !size) {
+		free(old);
+		return 0;
+	}
+	entered = enter();
+	if (foreign_remove(old)) {
+		mem = __libc_realloc(old, size);
+		foreign_insert(mem ? mem : old);
+	} else if (!entered) {
+		/* The heap growing one of its own tables */
+		mem = foreign_insert(__libc_realloc(old, size));
+	} else {
+		mem = cclass_realloc(old, size, caller_name(caller), 0);
+	}
+	if (entered) {
+		leave();
+	}
+	if (!mem) {
+		errno = ENOMEM;
+	}
+
+	return mem;
+}
+
+/**
+ * @brief Interposed malloc()
+ *
+ * @param size  size in bytes
+ *
+ * @return heap object, or 0
+ */
+void *
+malloc(size_t size)
+{
+	const void *caller = __builtin_return_address(0);
+	void *mem;
+
+	if (!enter()) {
+		return foreign_insert(__libc_malloc(size));
+	}
+	mem = cclass_malloc(size, 0, caller_name(caller), 0);
+	leave();
+	if (!mem) {
+		errno = ENOMEM;
+	}
+
+	return mem;
+}
+
+/**
+ * @brief Interposed calloc()
+ *
+ * @param n  number of elements
+ * @param size  element size in bytes
+ *
+ * @return zeroed heap object, or 0
+ */
+void *
+calloc(size_t n, size_t size)
+{
+	const void *caller = __builtin_return_address(0);
+	void *mem;
+
+	if (size && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return 0;
+	}
+	if (!enter()) {
+		mem = __libc_calloc(n, size);
+		return foreign_insert(mem);
+	}
+	mem = cclass_malloc(n * size, 0, caller_name(caller), 0);
+	leave();
+	if (mem) {
+		memset(mem, 0, n * size);
+	} else {
+		errno = ENOMEM;
+	}
+
+	return mem;
+}
+
+/**
+ * @brief Interposed realloc()
+ *
+ * Foreign blocks stay foreign.
+ *
+ * @param old  heap pointer, or 0
+ * @param size  new size in bytes
+ *
+ * @return resized heap object, or 0
+ */
+void *
+realloc(void *old, size_t size)
+{
+	return resize(old, size, __builtin_return_address(0));
+}
+
+/**
+ * @brief Interposed reallocarray()
+ *
+ * @param old  heap pointer, or 0
+ * @param n  number of elements
+ * @param size  element size in bytes
+ *
+ * @return resized heap object, or 0
+ */
+void *
+reallocarray(void *old, size_t n, size_t size)
+{
+	if (size && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	return resize(old, n * size, __builtin_return_address(0));
+}
+
+/**
+ * @brief Interposed free()
+ *
+ * A heap object freed while the heap is busy is left alone: the heap
+ * cannot be entered twice.
+ *
+ * @param mem  heap pointer, or 0
+ */
+void
+free(void *mem)
+{
+	bool entered;
+
+	if (!mem) {
+		return;
+	}
+	entered = enter();
+	if (foreign_remove(mem)) {
+		__libc_free(mem);
+	} else if (entered) {
+		cclass_free(mem);
+	}
+	if (entered) {
+		leave();
+	}
+}
+
+/**
+ * @brief Interposed malloc_usable_size()
+ *
+ * @param mem  heap pointer, or 0
+ *
+ * @return usable bytes of mem
+ */
+size_t
+malloc_usable_size(void *mem)
+{
+	bool entered;
+	size_t size;
+
+	if (!mem) {
+		return 0;
+	}
+	entered = enter();
+	if (foreign_contains(mem)) {
+		size = libc_usable_size(mem);
+	} else {
+		size = cclass_usable_size(mem);
+	}
+	if (entered) {
+		leave();
+	}
+
+	return size;
+}
+
+/**
+ * @brief Interposed strdup()
+ *
+ * @param s  string to duplicate
+ *
+ * @return heap copy of s, or 0
+ */
+char *
+strdup(const char *s)
+{
+	const void *caller = __builtin_return_address(0);
+	size_t size = strlen(s) + 1;
+	char *mem;
+
+	if (!enter()) {
+		mem = (char *) foreign_insert(__libc_malloc(size));
+	} else {
+		mem = (char *) cclass_malloc(size, 0, caller_name(caller), 0);
+		leave();
+	}
+	if (mem) {
+		memcpy(mem, s, size);
+	} else {
+		errno = ENOMEM;
+	}
+
+	return mem;
+}
+
+/**
+ * @brief Interposed posix_memalign(), served by the C library
+ */
+int
+posix_memalign(void **mem, size_t alignment, size_t size)
+{
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+		return EINVAL;
+	}
+	*mem = foreign_alloc(alignment, size);
+
+	return (*mem ? 0 : ENOMEM);
+}
+
+/**
+ * @brief Interposed aligned_alloc(), served by the C library
+ */
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	return foreign_alloc(alignment, size);
+}
+
+/**
+ * @brief Interposed memalign(), served by the C library
+ */
+void *
+memalign(size_t alignment, size_t size)
+{
+	return foreign_alloc(alignment, size);
+}
+
+/**
+ * @brief Interposed valloc(), served by the C library
+ */
+void *
+valloc(size_t size)
+{
+	return foreign_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+/**
+ * @brief Interposed pvalloc(), served by the C library
+ */
+void *
+pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - page + 1) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	return foreign_alloc(page, size ? (size + page - 1) & ~(page - 1) :
+			     page);
+}
+
+/**
+ * @brief Take the lock before fork()
+ */
+static void
+fork_prepare(void)
+{
+	enter();
+}
+
+/**
+ * @brief Start tracking
+ *
+ * Hold the lock across fork() so the child does not inherit it taken,
+ * and publish metrics when asked to.
+ */
+static void __attribute__((constructor))
+preload_init(void)
+{
+	pthread_atfork(fork_prepare, leave, leave);
+	if (getenv("CCLASS_METRICS") && enter()) {
+		cclass_metrics_publish();
+		leave();
+	}
+}
+
+/**
+ * @brief Stop tracking
+ *
+ * Walk the heap of live objects when asked to.  The walk prints to
+ * stdout, which is pointed at stderr meanwhile.
+ */
+static void __attribute__((destructor))
+preload_fini(void)
+{
+	int out;
+
+	if (getenv("CCLASS_WALK") && enter()) {
+		fflush(stdout);
+		out = dup(STDOUT_FILENO);
+		if (out >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0) {
+			printf("cclass: %d live objects\n",
+			       cclass_walk_heap());
+			fflush(stdout);
+			dup2(out, STDOUT_FILENO);
+		}
+		if (out >= 0) {
+			close(out);
+		}
+		leave();
+	}
+}
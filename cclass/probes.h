@@ -0,0 +1,88 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Static tracepoints declaration
+ *
+ * Probes of provider "cclass" on the allocation paths, for bpftrace,
+ * perf or SystemTap to attach to a running process:
+ * @code
+ * bpftrace -e 'usdt:/usr/lib/libcclass.so:cclass:malloc_return
+ *     { printf("%p %d %s\n", arg0, arg1, str(arg2)); }'
+ * @endcode
+ *
+ * A probe is a nop instruction plus a note in the ELF file, so probes
+ * cost nothing measurable while no tracer is attached.  Without
+ * sys/sdt.h (systemtap-sdt-dev) the probes are left out.
+ *
+ * Probes and arguments:
+ * - malloc_entry(size, class, file, line)
+ * - malloc_return(ptr, size, class, file, line)
+ * - realloc_entry(old, size, file, line)
+ * - realloc_return(ptr, old, size, class, file, line), also after
+ *   realloc of a null or invalid old pointer, so entry and return pair
+ * - free_entry(ptr)
+ * - free_return(ptr, size, class, file, line), file and line of the
+ *   allocation
+ * - malloc_batch_entry(n, size, class, file, line)
+ * - malloc_batch_return(mem, n, size, class, file, line)
+ * - free_batch_entry(mem, n)
+ * - free_batch_return(mem, freed), freed counts the objects released
+ *   together, not those with a fini hook or owned objects
+ * - verify_fail(ptr), a pointer that is not a live heap object
+ * - assert(file, line), from cclass_assert_report()
+ *
+ * The class argument is the class name, or "" for objects without a
+ * class.
+ */
+#ifndef ITL_CCLASS_PROBES_H
+#define ITL_CCLASS_PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#ifndef DOXYGEN_SKIP
+#ifdef HAVE_SYS_SDT_H
+#define CCLASS_PROBE1(name, a) \
+  DTRACE_PROBE1(cclass, name, a)
+#define CCLASS_PROBE2(name, a, b) \
+  DTRACE_PROBE2(cclass, name, a, b)
+#define CCLASS_PROBE4(name, a, b, c, d) \
+  DTRACE_PROBE4(cclass, name, a, b, c, d)
+#define CCLASS_PROBE5(name, a, b, c, d, e) \
+  DTRACE_PROBE5(cclass, name, a, b, c, d, e)
+#define CCLASS_PROBE6(name, a, b, c, d, e, f) \
+  DTRACE_PROBE6(cclass, name, a, b, c, d, e, f)
+#else
+#define CCLASS_PROBE1(name, a) do { } while (0)
+#define CCLASS_PROBE2(name, a, b) do { } while (0)
+#define CCLASS_PROBE4(name, a, b, c, d) do { } while (0)
+#define CCLASS_PROBE5(name, a, b, c, d, e) do { } while (0)
+#define CCLASS_PROBE6(name, a, b, c, d, e, f) do { } while (0)
+#endif /* HAVE_SYS_SDT_H */
+
+/* Class name argument of a probe */
+#define CCLASS_PROBE_CLASS(class) ((class) ? (class)->name : "")
+#endif /* DOXYGEN_SKIP */
+
+#endif /* ITL_CCLASS_PROBES_H */
@@ -0,0 +1,118 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Allocation trace declaration
+ *
+ * An allocation trace records every allocation, reallocation and free
+ * of the heap in a binary file, for cclass-replay to run against the
+ * heap again.  The file starts with a cclass_trace_header, followed by
+ * events.  Events are buffered per thread and flushed a buffer at a
+ * time, so they are ordered by time within a thread only.
+ *
+ * Site and class events name a site or class before its first use.
+ * Their name follows the event, NUL padded to a whole number of events.
+ */
+#ifndef ITL_CCLASS_TRACE_H
+#define ITL_CCLASS_TRACE_H
+
+#include <stdbool.h> /* bool */
+#include <stdint.h> /* uint32_t, uint64_t */
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/**
+ * @def CCLASS_TRACE_MAGIC
+ * @brief Magic number at the start of a trace file
+ */
+#define CCLASS_TRACE_MAGIC 0x63637472
+
+/**
+ * @def CCLASS_TRACE_VERSION
+ * @brief Version of the trace file layout
+ */
+#define CCLASS_TRACE_VERSION 1
+
+/** Trace event kinds */
+typedef enum cclass_trace_op_tag {
+	CCLASS_TRACE_MALLOC = 1, /**< block allocated */
+	CCLASS_TRACE_REALLOC, /**< block resized, maybe moved */
+	CCLASS_TRACE_FREE, /**< block freed */
+	CCLASS_TRACE_SITE, /**< site named */
+	CCLASS_TRACE_CLASS, /**< class named */
+} cclass_trace_op;
+
+/** Trace file header */
+typedef struct cclass_trace_header_tag {
+	uint32_t magic; /**< CCLASS_TRACE_MAGIC */
+	uint32_t version; /**< CCLASS_TRACE_VERSION */
+	uint32_t event_size; /**< sizeof(cclass_trace_event) */
+	uint32_t pid; /**< traced process */
+} cclass_trace_header;
+
+/**
+ * Trace event
+ *
+ * Blocks are identified by their address, which may be reused once the
+ * block is freed.
+ */
+typedef struct cclass_trace_event_tag {
+	uint64_t time; /**< nanoseconds since the trace started */
+	uint64_t block; /**< block id, or name length of site and class */
+	uint64_t old; /**< previous block id of a reallocated block */
+	uint64_t size; /**< aligned payload size, line of site, flags of class */
+	uint64_t class; /**< class id, or 0 */
+	uint32_t thread; /**< thread id */
+	uint32_t site; /**< site id */
+	uint32_t op; /**< cclass_trace_op */
+	uint32_t reserved; /**< zero */
+} cclass_trace_event;
+
+/**
+ * @brief Start recording an allocation trace
+ *
+ * Create the trace file, replacing any existing file, and record every
+ * heap operation from now on.  Sites and classes already in use are
+ * named first.
+ *
+ * @param path  trace file name
+ *
+ * @return true if the trace file was created
+ *
+ * Usage:
+ * @code
+ * cclass_trace_start("app.trace");
+ * // ...
+ * cclass_trace_stop();
+ * // run: cclass-replay app.trace
+ * @endcode
+ */
+bool cclass_trace_start(const char *path);
+
+/**
+ * @brief Stop recording an allocation trace
+ *
+ * Flush the buffers of all threads and close the trace file.  No thread
+ * may be using the heap meanwhile.
+ */
+void cclass_trace_stop(void);
+
+__END_DECLS
+
+#endif /* ITL_CCLASS_TRACE_H */
@@ -0,0 +1,172 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Test the C++ allocator on standard containers
+ */
+#include <check.h>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <new>
+#include <vector>
+
+#include "cclass/allocator.hpp"
+#include "cclass/classdef.h"
+
+USE_XASSERT
+
+/**
+ * @brief Place map nodes in a pool of their own
+ */
+static
+void
+alloc_map(void)
+{
+	typedef std::pair<const int, int> entry;
+	typedef std::map<int, int, std::less<int>, cclass::allocator<entry> >
+	    map_t;
+	cclass::pool nodes("nodes");
+	cclass::allocator<entry> allocator(nodes);
+	{
+		map_t map(allocator);
+		for (int i = 0; i < 1000; i++) {
+			map[i] = i;
+		}
+		XASSERT(nodes.desc()->count == 1000) {
+			/* empty */
+		}
+
+		/* copies allocate from the same pool */
+		map_t copy(map);
+		XASSERT(nodes.desc()->count == 2000) {
+			/* empty */
+		}
+	}
+	XASSERT(nodes.desc()->count == 0) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Grow buffers and nodes from the default pool
+ */
+static
+void
+alloc_default(void)
+{
+	std::vector<int, cclass::allocator<int> > vector;
+	std::list<int, cclass::allocator<int> > list;
+
+	for (int i = 0; i < 100; i++) {
+		vector.push_back(i);
+		list.push_back(i);
+	}
+	XASSERT(cclass_test_pointer(vector.data()) &&
+		cclass::default_pool().desc()->count == 101) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Throw std::bad_alloc when an allocation fails
+ */
+static
+void
+alloc_bad(void)
+{
+	cclass::allocator<long> allocator;
+	bool thrown = false;
+
+	try {
+		allocator.allocate(allocator.max_size() + 1);
+	} catch (const std::bad_alloc &) {
+		thrown = true;
+	}
+	XASSERT(thrown) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Test alloc_map()
+ */
+START_TEST(test_alloc_map)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_map));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_default()
+ */
+START_TEST(test_alloc_default)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_default));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_bad()
+ */
+START_TEST(test_alloc_bad)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_bad));
+}
+END_TEST
+
+/**
+ * @brief Create test suite
+ *
+ * @return test suite
+ */
+static
+Suite *
+allocator_suite(void)
+{
+	Suite *s = suite_create("allocator");
+
+	TCase *tc_core = tcase_create("Core");
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, test_alloc_map);
+	tcase_add_test(tc_core, test_alloc_default);
+	tcase_add_test(tc_core, test_alloc_bad);
+
+	return s;
+}
+
+/**
+ * @brief allocator test program
+ *
+ * @return:
+ * - EXIT_SUCCESS if all tests succeeded
+ * - EXIT_FAILURE if any test fails
+ */
+int
+main(void)
+{
+	XASSERT_INTERACTIVE = false;
+
+	int nf;
+	Suite *s = allocator_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	nf = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
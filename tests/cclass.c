@@ -22,12 +22,20 @@
 #include <check.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "cclass/metrics.h"
+#include "cclass/trace.h"
 #include "config.h"
 #include "dummy.h"
 #include "redirect.h" /* redirect_dev_null() */
 #include "verbose-argp.h" /* verbose,verbose_argp */
 
+USE_XASSERT
+
 /**
  * @def PROGRAM_NAME
  * @brief program name
@@ -60,6 +68,31 @@ static struct argp argp = {
 	.children = argp_children,
 };
 
+/**
+ * @brief critical object handle
+ */
+NEWHANDLE(critical_t);
+
+/**
+ * @brief critical object, allocated even under memory pressure
+ */
+CLASS_WITH(critical, critical_t, .flags = CCLASS_CRITICAL) {
+	int value; /**< payload */
+};
+
+/**
+ * @brief record object handle
+ */
+NEWHANDLE(record_t);
+
+/**
+ * @brief record object, kept in the persistent heap
+ */
+CLASS(record, record_t) {
+	int value; /**< payload */
+	record_t next; /**< next record or 0 */
+};
+
 /**
  * @brief Allocate and free memory
  */
@@ -87,33 +120,1383 @@ alloc_nofree(void)
 }
 
 /**
- * @brief Setup function for test suite
+ * @brief Allocate many objects and free them out of order
  */
 static
 void
-setup(void)
+alloc_many(void)
 {
-	if (!verbose) {
-		redirect_dev_null(stderr);
-		redirect_dev_null(stdout);
+	dummy_t dummy[3000];
+	cclass_stats stats;
+	int n = NUMSTATICELS(dummy);
+
+	for (int i = 0; i < n; i++) {
+		dummy[i] = dummy_create(i % 7);
+	}
+
+	/* free every other object, so registry slots get refilled */
+	for (int i = 0; i < n; i += 2) {
+		dummy[i] = dummy_destroy(dummy[i]);
+	}
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == (size_t) n) {
+		/* empty: each remaining dummy owns two blocks */
+	}
+	XASSERT(cclass_walk_heap() == n) {
+		/* empty */
+	}
+
+	for (int i = n - 1; i > 0; i -= 2) {
+		dummy_set(dummy[i], 1);
+		dummy[i] = dummy_destroy(dummy[i]);
 	}
 }
 
 /**
- * @brief Test alloc_free()
+ * @brief Allocate and free a batch of objects
  */
-START_TEST(test_alloc_free)
+static
+void
+alloc_batch(void)
 {
-	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_free));
+	dummy_t dummy[100];
+	char *str[41];
+	cclass_stats stats;
+	int n = NUMSTATICELS(dummy);
+
+	XASSERT(dummy_create_batch(dummy, n, 10) == n) {
+		for (int i = 0; i < n; i++) {
+			XASSERT(dummy_set(dummy[i], i)) {
+				/* empty: each object verifies */
+			}
+		}
+	}
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == 2 * (size_t) n) {
+		/* empty */
+	}
+
+	/* objects from a batch may also be destroyed one by one */
+	dummy[0] = dummy_destroy(dummy[0]);
+	dummy_destroy_batch(dummy, n);
+
+	/* blocks without hooks are released per slab and arena run */
+	XASSERT(cclass_malloc_batch(30, 12, 0, (void **) str, SRCFILE,
+				    __LINE__)) {
+		cclass_set_hugepage(true);
+		for (int i = 30; i < 40; i++) {
+			NEWSTRING(str[i], 20);
+		}
+		cclass_set_hugepage(false);
+		XASSERT(!((size_t) str[1] % __alignof__(long double))) {
+			/* empty: slab objects hold any type */
+		}
+		str[40] = 0;
+		FREEOBJ(str[12]);
+		cclass_free_batch((void **) str, NUMSTATICELS(str));
+		cclass_heap_stats(&stats);
+		XASSERT(!stats.blocks && !str[0] && !str[39]) {
+			/* empty */
+		}
+	}
 }
-END_TEST
 
 /**
- * @brief Test alloc_nofree()
+ * @brief Destroy all objects of a class without walking the heap
  */
-START_TEST(test_alloc_nofree)
+static
+void
+alloc_foreach(void)
 {
-	fail_unless(EXIT_FAILURE == cclass_assert_test(alloc_nofree));
+	dummy_t dummy[50];
+	int n = NUMSTATICELS(dummy);
+	char *str;
+
+	NEWSTRING(str, 10);
+	for (int i = 0; i < n; i++) {
+		dummy[i] = dummy_create(i);
+	}
+	dummy[3] = dummy_destroy(dummy[3]);
+
+	XASSERT(dummy_destroy_all() == n - 1) {
+		/* empty */
+	}
+	XASSERT(dummy_destroy_all() == 0) {
+		/* empty */
+	}
+	FREEOBJ(str);
+}
+
+/** number of pressure function calls */
+static int pressure_calls;
+
+/**
+ * @brief Count memory pressure signals
+ *
+ * @param desc  class descriptor, or 0 for the global budget
+ * @param bytes  live bytes charged
+ */
+static
+void
+pressure(classdesc *desc,
+	 size_t bytes)
+{
+	(void) desc;
+	(void) bytes;
+	pressure_calls++;
+}
+
+/**
+ * @brief Allocate until the global budget refuses
+ */
+static
+void
+alloc_budget(void)
+{
+	char *str[64];
+	critical_t critical;
+	cclass_stats stats;
+	int n = NUMSTATICELS(str);
+	int i;
+
+	pressure_calls = 0;
+	cclass_set_budget(4096, 2048, pressure);
+	for (i = 0; i < n; i++) {
+		if (!NEWSTRING(str[i], 100)) {
+			break;
+		}
+	}
+	XASSERT(i > 0 && i < n && pressure_calls >= 2) {
+		/* empty: soft limit crossed, then hard limit reached */
+	}
+
+	/* critical objects are charged but never refused */
+	NEWOBJ(critical);
+	cclass_heap_stats(&stats);
+	XASSERT(critical && stats.charged > 4096) {
+		FREEOBJ(critical);
+	}
+
+	while (i--) {
+		FREEOBJ(str[i]);
+	}
+	cclass_heap_stats(&stats);
+	XASSERT(stats.charged == 0) {
+		/* empty */
+	}
+	cclass_set_budget(0, 0, 0);
+}
+
+/** object freed by shed(), or 0 */
+static char *shed_victim;
+
+/**
+ * @brief Shed load by freeing the victim object
+ *
+ * @param desc  class descriptor, or 0 for the global budget
+ * @param bytes  live bytes charged
+ */
+static
+void
+shed(classdesc *desc,
+     size_t bytes)
+{
+	(void) desc;
+	(void) bytes;
+	FREEOBJ(shed_victim);
+}
+
+/**
+ * @brief Shed the object being reallocated, once realloc is done
+ */
+static
+void
+alloc_budget_realloc(void)
+{
+	cclass_stats stats;
+
+	/* grow in place, within the arena block, across the soft limit */
+	cclass_set_hugepage(true);
+	NEWSTRING(shed_victim, 110);
+	cclass_heap_stats(&stats);
+	cclass_set_budget(0, stats.charged + 8, shed);
+	XASSERT(cclass_realloc(shed_victim, 130, SRCFILE, __LINE__)) {
+		/* empty: the pressure function ran after the realloc */
+	}
+	cclass_heap_stats(&stats);
+	XASSERT(!shed_victim && !stats.blocks && !stats.charged) {
+		/* empty */
+	}
+	cclass_set_budget(0, 0, 0);
+	cclass_set_hugepage(false);
+}
+
+/** number of backend allocations */
+static int backend_allocs;
+
+/** number of backend allocations before failure injection, or -1 */
+static int backend_fail_after = -1;
+
+/**
+ * @brief Counting backend malloc() with failure injection
+ *
+ * @param size  number of bytes to allocate
+ *
+ * @return allocated memory or 0
+ */
+static
+void *
+stub_malloc(size_t size)
+{
+	if (backend_fail_after >= 0 && backend_allocs >= backend_fail_after) {
+		return 0;
+	}
+	backend_allocs++;
+	return malloc(size);
+}
+
+/**
+ * @brief Counting backend realloc() with failure injection
+ *
+ * @param p  memory to resize
+ * @param size  new number of bytes
+ *
+ * @return resized memory or 0
+ */
+static
+void *
+stub_realloc(void *p,
+	     size_t size)
+{
+	if (backend_fail_after >= 0 && backend_allocs >= backend_fail_after) {
+		return 0;
+	}
+	backend_allocs++;
+	return realloc(p, size);
+}
+
+/** counting backend with failure injection */
+static const cclass_backend stub_backend = {
+	.malloc = stub_malloc,
+	.realloc = stub_realloc,
+	.free = free,
+};
+
+/**
+ * @brief Allocate through a counting backend
+ */
+static
+void
+alloc_backend(void)
+{
+	dummy_t dummy[10];
+	int n = NUMSTATICELS(dummy);
+
+	backend_allocs = 0;
+	backend_fail_after = -1;
+	XASSERT(cclass_set_backend(&stub_backend)) {
+		dummy_create_batch(dummy, n, 10);
+		XASSERT(backend_allocs == 1 + n) {
+			/* empty: one slab, plus one string per object */
+		}
+		dummy_destroy_batch(dummy, n);
+		cclass_set_backend(0);
+	}
+}
+
+/**
+ * @brief Allocate through a backend that runs out of memory
+ */
+static
+void
+alloc_backend_fail(void)
+{
+	dummy_t dummy;
+
+	backend_allocs = 0;
+	backend_fail_after = 1;
+	XASSERT(cclass_set_backend(&stub_backend)) {
+		/* object is allocated, its string is not */
+		dummy = dummy_create(10);
+		dummy = dummy_destroy(dummy);
+		cclass_set_backend(0);
+	}
+}
+
+/**
+ * @brief Allocate from the huge page arena
+ */
+static
+void
+alloc_hugepage(void)
+{
+	dummy_t dummy[100];
+	cclass_arena_info info;
+	char *str;
+	int n = NUMSTATICELS(dummy);
+
+	cclass_set_hugepage(true);
+	dummy_create_batch(dummy, n, 10);
+	NEWSTRING(str, 10);
+	RESIZEARRAY(str, 1000);
+	RESIZEARRAY(str, 20);
+
+	cclass_arena_stats(&info);
+	XASSERT(info.regions && info.used && info.used <= info.mapped) {
+		/* empty */
+	}
+
+	FREEOBJ(str);
+	dummy_destroy_batch(dummy, n);
+	cclass_arena_stats(&info);
+	XASSERT(info.used == 0) {
+		/* empty: regions are kept for reuse */
+	}
+	cclass_set_hugepage(false);
+}
+
+/**
+ * @brief Allocate critical objects when the backend has no memory
+ */
+static
+void
+alloc_reserve(void)
+{
+	critical_t critical;
+
+	XASSERT(cclass_set_reserve(1) > 0) {
+		backend_allocs = 0;
+		backend_fail_after = 0;
+		XASSERT(cclass_set_backend(&stub_backend)) {
+			NEWOBJ(critical);
+			XASSERT(critical) {
+				critical->value = 1;
+				FREEOBJ(critical);
+			}
+			cclass_set_backend(0);
+		}
+	}
+}
+
+/**
+ * @brief Count objects in published metrics
+ */
+static
+void
+alloc_metrics(void)
+{
+	const cclass_metrics *m = cclass_metrics_publish();
+	critical_t critical;
+	int64_t blocks;
+	uint64_t allocs;
+
+	XASSERT(m && m->magic == CCLASS_METRICS_MAGIC) {
+		blocks = m->total.blocks;
+		allocs = m->total.allocs;
+		NEWOBJ(critical);
+		XASSERT(critical && m->total.blocks == blocks + 1 &&
+			m->total.allocs == allocs + 1 && m->classes >= 2 &&
+			m->sites >= 2) {
+			FREEOBJ(critical);
+		}
+		XASSERT(m->total.blocks == blocks &&
+			m->total.frees == m->total.allocs - blocks) {
+			/* empty */
+		}
+		cclass_metrics_unpublish();
+	}
+}
+
+/**
+ * @brief Record heap operations in an allocation trace
+ */
+static
+void
+alloc_trace(void)
+{
+	char path[] = "/tmp/cclass-trace-XXXXXX";
+	int fd = mkstemp(path);
+	int ops[CCLASS_TRACE_CLASS + 1] = { 0 };
+	cclass_trace_header header;
+	cclass_trace_event event;
+	critical_t critical;
+	char *str;
+	FILE *f;
+
+	XASSERT(fd >= 0 && cclass_trace_start(path)) {
+		NEWOBJ(critical);
+		NEWSTRING(str, 10);
+		RESIZEARRAY(str, 100);
+		FREEOBJ(str);
+		FREEOBJ(critical);
+		cclass_trace_stop();
+	}
+
+	/* Count events, skipping names */
+	f = fdopen(fd, "rb");
+	XASSERT(f && fread(&header, sizeof(header), 1, f) == 1 &&
+		header.magic == CCLASS_TRACE_MAGIC) {
+		while (fread(&event, sizeof(event), 1, f) == 1) {
+			if (event.op <= CCLASS_TRACE_CLASS) {
+				ops[event.op]++;
+			}
+			if (event.op >= CCLASS_TRACE_SITE) {
+				fseek(f, (event.block + sizeof(event)) /
+				      sizeof(event) * sizeof(event), SEEK_CUR);
+			}
+		}
+	}
+	XASSERT(ops[CCLASS_TRACE_MALLOC] == 2 &&
+		ops[CCLASS_TRACE_REALLOC] == 1 &&
+		ops[CCLASS_TRACE_FREE] == 2 && ops[CCLASS_TRACE_CLASS] == 1) {
+		/* empty */
+	}
+	if (f) {
+		fclose(f);
+	}
+	unlink(path);
+}
+
+/**
+ * @brief Time heap operations
+ */
+static
+void
+alloc_latency(void)
+{
+	cclass_latency_info before, info;
+	critical_t critical;
+	int i;
+
+	cclass_latency(&critical_classdesc, CCLASS_LATENCY_MALLOC, &before);
+	cclass_set_latency(true);
+	for (i = 0; i < 100; i++) {
+		NEWOBJ(critical);
+		FREEOBJ(critical);
+	}
+	cclass_set_latency(false);
+	NEWOBJ(critical);
+	FREEOBJ(critical);
+
+	XASSERT(cclass_latency(&critical_classdesc, CCLASS_LATENCY_MALLOC,
+			       &info) &&
+		info.count == before.count + 100) {
+		XASSERT(info.p50 <= info.p99 && info.p99 <= info.p999 &&
+			info.p999 <= info.max) {
+			/* empty */
+		}
+	}
+	XASSERT(cclass_latency(0, CCLASS_LATENCY_FREE, &info) &&
+		info.count >= 100) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Share interned strings
+ */
+static
+void
+alloc_intern(void)
+{
+	char key[] = "some key";
+	const char *a, *b, *c;
+	cclass_intern_info before, info;
+
+	cclass_intern_stats(&before);
+	INTERN(a, "some key");
+	INTERN(b, key);
+	INTERN(c, "other key");
+	cclass_intern_stats(&info);
+	XASSERT(a && a == b && a != key && c && c != a &&
+		!strcmp(c, "other key")) {
+		/* empty */
+	}
+	XASSERT(info.strings == before.strings + 2 &&
+		info.lookups == before.lookups + 3 &&
+		info.hits == before.hits + 1) {
+		/* empty */
+	}
+
+	/* The copy outlives one release */
+	UNINTERN(a);
+	XASSERT(!a && !strcmp(b, "some key")) {
+		/* empty */
+	}
+	UNINTERN(b);
+	UNINTERN(c);
+	cclass_intern_stats(&info);
+	XASSERT(info.strings == before.strings &&
+		info.bytes == before.bytes) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Account for memory overhead
+ */
+static
+void
+alloc_overhead(void)
+{
+	cclass_overhead before, info;
+	critical_t critical;
+	char *str;
+
+	cclass_overhead_stats(0, &before);
+	NEWSTRING(str, 5);
+	NEWOBJ(critical);
+	cclass_overhead_stats(0, &info);
+	XASSERT(info.blocks == before.blocks + 2 &&
+		info.payload == before.payload + 5 + sizeof(*critical) &&
+		info.rounding > before.rounding &&
+		info.headers > before.headers &&
+		info.fragmentation > 0 && info.fragmentation < 1) {
+		/* empty */
+	}
+
+	cclass_overhead_stats(&critical_classdesc, &info);
+	XASSERT(info.blocks == 1 && info.payload == sizeof(*critical) &&
+		info.arena_free == 0) {
+		/* empty */
+	}
+	cclass_overhead_report();
+
+	FREEOBJ(critical);
+	FREEOBJ(str);
+}
+
+/**
+ * @brief Free objects along with their owner
+ */
+static
+void
+alloc_child(void)
+{
+	cclass_stats before, stats;
+	critical_t critical;
+	char *name;
+	char *part;
+	char *leaf;
+
+	cclass_heap_stats(&before);
+	NEWSTRING(name, 10);
+	NEWOBJ_CHILD(critical, name);
+	NEWSTRING_CHILD(part, 10, critical);
+	NEWSTRING_CHILD(leaf, 10, name);
+	RESIZEARRAY(critical, 1000);
+	XASSERT(cclass_parent(critical) == name &&
+		cclass_parent(part) == critical &&
+		cclass_parent(leaf) == name && !cclass_parent(name)) {
+		/* empty */
+	}
+
+	/* a child may still be freed on its own */
+	FREEOBJ(leaf);
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == before.blocks + 3) {
+		/* empty */
+	}
+	cclass_walk_heap();
+
+	FREEOBJ(name);
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == before.blocks &&
+		stats.bytes == before.bytes) {
+		/* empty */
+	}
+
+	/* a child retained elsewhere outlives its owner, with its own */
+	NEWSTRING(name, 10);
+	NEWOBJ_CHILD(critical, name);
+	NEWSTRING_CHILD(part, 10, critical);
+	NEWSTRING_CHILD(leaf, 10, name);
+	XASSERT(cclass_retain(critical) == critical) {
+		/* empty */
+	}
+	FREEOBJ(name);
+	VERIFY(critical) {
+		critical->value = 1;
+	}
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == before.blocks + 2 &&
+		!cclass_parent(critical) &&
+		cclass_parent(part) == critical) {
+		/* empty */
+	}
+	RELEASEOBJ(critical);
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == before.blocks &&
+		stats.bytes == before.bytes) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Reattach to objects in a persistent heap
+ */
+static
+void
+alloc_persist(void)
+{
+	char path[] = "/tmp/cclass-persist-XXXXXX";
+	void *base = (void *) 0x600000000000;
+	classdesc *classes[] = { &_CD(record) };
+	record_t record;
+	record_t next;
+	int fd = mkstemp(path);
+
+	XASSERT(fd >= 0 && !close(fd) &&
+		cclass_persist_open(path, base, 4 << 20, classes, 1)) {
+		NEWOBJ(record);
+		record->value = 2;
+		next = record;
+		NEWOBJ(record);
+		record->value = 1;
+		record->next = next;
+		cclass_persist_set_root(record);
+		XASSERT((void *) record > base &&
+			(char *) record < (char *) base + (4 << 20)) {
+			/* empty */
+		}
+		cclass_persist_close();
+	}
+
+	/* no objects left in this process, until reopened */
+	XASSERT(!cclass_persist_root() && !_CD(record).count) {
+		/* empty */
+	}
+	XASSERT(cclass_persist_open(path, base, 0, classes, 1)) {
+		record = cclass_persist_root();
+		XASSERT(_CD(record).count == 2 && record->value == 1 &&
+			record->next->value == 2) {
+			cclass_walk_heap();
+			next = record->next;
+			FREEOBJ(record);
+			record = next;
+			FREEOBJ(record);
+		}
+		cclass_persist_set_root(0);
+		cclass_persist_close();
+	}
+
+	/* a heap is refused at another base address */
+	XASSERT(!cclass_persist_open(path, (char *) base + (1 << 30), 0,
+				     classes, 1)) {
+		/* empty */
+	}
+	unlink(path);
+}
+
+/**
+ * @brief Read objects allocated by another process
+ */
+static
+void
+alloc_shared(void)
+{
+	char name[32];
+	void *base = (void *) 0x600000000000;
+	classdesc *classes[] = { &_CD(record) };
+	record_t record = 0;
+	record_t list = 0;
+	int status = -1;
+	int n = 0;
+	pid_t pid;
+
+	snprintf(name, sizeof(name), "/cclass-test.%d", (int) getpid());
+	XASSERT(cclass_shared_open(name, base, 4 << 20, classes, 1)) {
+		pid = fork();
+		if (!pid) {
+			/* reopen as any other process would */
+			cclass_persist_close();
+			if (!cclass_shared_open(name, base, 0, classes, 1)) {
+				_exit(EXIT_FAILURE);
+			}
+			for (int i = 0; i < 1000; i++) {
+				NEWOBJ(record);
+				record->value = i;
+				record->next = list;
+				list = record;
+			}
+			cclass_persist_set_root(list);
+			_exit(EXIT_SUCCESS);
+		}
+
+		/* allocate alongside the other process */
+		for (int i = 0; i < 1000; i++) {
+			NEWOBJ(record);
+			record->next = list;
+			list = record;
+		}
+		waitpid(pid, &status, 0);
+		XASSERT(WIFEXITED(status) && !WEXITSTATUS(status)) {
+			for (record = cclass_persist_root(); record;
+			     record = record->next) {
+				VERIFY(record) {
+					n += (record->value == 999 - n);
+				}
+			}
+		}
+		XASSERT(n == 1000) {
+			/* empty */
+		}
+		while (list) {
+			record = list;
+			list = list->next;
+			FREEOBJ(record);
+		}
+		cclass_persist_close();
+		shm_unlink(name);
+	}
+}
+
+/**
+ * @brief Look objects up through handles that outlive them
+ */
+static
+void
+alloc_handle(void)
+{
+	cclass_handle handle;
+	cclass_handle other;
+	critical_t critical;
+	char *str;
+
+	NEWOBJ_HANDLE(critical, handle);
+	VERIFY_HANDLE(critical, handle) {
+		critical->value = 1;
+	}
+	XASSERT(handle && cclass_handle_of(critical) == handle) {
+		/* empty */
+	}
+
+	/* the handle follows the object when it moves */
+	RESIZEARRAY(critical, 1000);
+	XASSERT(cclass_handle_object(handle, 0) == critical) {
+		/* empty */
+	}
+
+	/* a handle of another class is refused */
+	NEWSTRING(str, 10);
+	other = cclass_handle_of(str);
+	XASSERT(other && !cclass_handle_object(other, &_CD(critical))) {
+		/* empty */
+	}
+	FREEOBJ(str);
+
+	/* a freed object's slot is reused under a new generation */
+	FREEOBJ(critical);
+	XASSERT(!cclass_handle_object(handle, 0) &&
+		!cclass_handle_object(other, 0)) {
+		/* empty */
+	}
+	NEWOBJ_HANDLE(critical, other);
+	XASSERT(other != handle && (unsigned) other == (unsigned) handle &&
+		!cclass_handle_object(handle, &_CD(critical)) &&
+		cclass_handle_object(other, &_CD(critical)) == critical) {
+		/* empty */
+	}
+	FREEOBJ(critical);
+
+	XASSERT(!cclass_handle_object(0, 0) &&
+		!cclass_handle_object(0xffffffff, 0)) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Share an object by reference instead of copying it
+ */
+static
+void
+alloc_refs(void)
+{
+	cclass_stats before, stats;
+	critical_t critical;
+	critical_t shared;
+	critical_t other;
+
+	cclass_heap_stats(&before);
+	NEWOBJ(critical);
+	shared = cclass_retain(critical);
+	other = cclass_retain(shared);
+	XASSERT(shared == critical && other == critical &&
+		!cclass_retain(0)) {
+		/* empty */
+	}
+
+	/* the creator may let go last, or first */
+	RELEASEOBJ(shared);
+	RELEASEOBJ(other);
+	VERIFY(critical) {
+		critical->value = 1;
+	}
+	cclass_heap_stats(&stats);
+	XASSERT(!shared && !other && stats.blocks == before.blocks + 1) {
+		/* empty */
+	}
+
+	/* the last release frees */
+	RELEASEOBJ(critical);
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == before.blocks &&
+		stats.bytes == before.bytes) {
+		/* empty */
+	}
+
+	/* freeing a shared object leaves it to the other holder */
+	shared = NEWOBJ(critical);
+	critical = cclass_retain(shared);
+	FREEOBJ(shared);
+	VERIFY(critical) {
+		critical->value = 2;
+	}
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == before.blocks + 1) {
+		/* empty */
+	}
+	RELEASEOBJ(critical);
+	cclass_heap_stats(&stats);
+	XASSERT(stats.blocks == before.blocks) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Group objects by the stack that allocated them
+ */
+static
+void
+alloc_backtrace(void)
+{
+	void *frame[2][8];
+	size_t depth[2];
+	char *name[2];
+	char *other;
+	char *str;
+	int captured = 0;
+	volatile int n = 2; /* keep the loop, and its one call site */
+
+	cclass_set_backtrace(8, 1);
+	for (int i = 0; i < n; i++) {
+		NEWSTRING(name[i], 10);
+		depth[i] = cclass_backtrace(name[i], frame[i], 8);
+	}
+	NEWSTRING(other, 10);
+
+	/* one code path, one stack */
+	XASSERT(depth[0] && depth[0] == depth[1] &&
+		!memcmp(frame[0], frame[1], depth[0] * sizeof(void *))) {
+		/* empty */
+	}
+	depth[1] = cclass_backtrace(other, frame[1], 8);
+	XASSERT(depth[1] && memcmp(frame[0], frame[1],
+				   depth[0] * sizeof(void *))) {
+		/* empty */
+	}
+	cclass_walk_heap();
+	cclass_stack_report();
+
+	/* one allocation in every period is captured */
+	cclass_set_backtrace(8, 2);
+	for (int i = 0; i < 4; i++) {
+		NEWSTRING(str, 10);
+		captured += !!cclass_backtrace(str, frame[0], 8);
+		FREEOBJ(str);
+	}
+	cclass_set_backtrace(0, 0);
+	NEWSTRING(str, 10);
+	XASSERT(captured == 2 && !cclass_backtrace(str, frame[0], 8)) {
+		/* empty */
+	}
+
+	FREEOBJ(str);
+	FREEOBJ(other);
+	FREEOBJ(name[0]);
+	FREEOBJ(name[1]);
+}
+
+/**
+ * @brief Reserve room for objects, by hand and from a profile
+ */
+static
+void
+alloc_profile(void)
+{
+	char path[] = "/tmp/cclass-profile-XXXXXX";
+	classdesc *classes[] = { &_CD(critical) };
+	cclass_arena_info before, info;
+	critical_t critical;
+	critical_t kept[100];
+	char name[64];
+	size_t peak = 0;
+	size_t bytes = 0;
+	int n = NUMSTATICELS(kept);
+	int fd = mkstemp(path);
+	FILE *file;
+
+	/* reserved arena blocks are handed out without mapping more */
+	cclass_set_hugepage(true);
+	XASSERT(cclass_class_reserve(&_CD(critical), n, sizeof(*critical)) &&
+		_CD(critical).capacity >= (size_t) n) {
+		/* empty */
+	}
+	cclass_arena_stats(&before);
+	for (int i = 0; i < n; i++) {
+		kept[i] = NEWOBJ(critical);
+	}
+	cclass_arena_stats(&info);
+	XASSERT(info.mapped == before.mapped && info.used > before.used &&
+		_CD(critical).peak >= (size_t) n) {
+		/* empty */
+	}
+	for (int i = 0; i < n; i++) {
+		FREEOBJ(kept[i]);
+	}
+	cclass_set_hugepage(false);
+
+	/* the first run finds no profile, and writes one */
+	XASSERT(fd >= 0 && !close(fd) && !unlink(path) &&
+		!cclass_profile_load(path, classes, 1) &&
+		cclass_profile_save()) {
+		file = fopen(path, "r");
+		XASSERT(file && fscanf(file, "%zu %zu %63s", &peak, &bytes,
+				       name) == 3) {
+			fclose(file);
+		}
+	}
+	XASSERT(peak == _CD(critical).peak && bytes >= peak * sizeof(int) &&
+		!strcmp(name, "critical")) {
+		/* empty */
+	}
+
+	/* the next run reserves from it */
+	XASSERT(cclass_profile_load(path, classes, 1)) {
+		/* empty */
+	}
+	cclass_profile_load(0, 0, 0);
+	XASSERT(!cclass_profile_save()) {
+		/* empty */
+	}
+	unlink(path);
+}
+
+/**
+ * @brief Place objects next to the objects they are used with
+ */
+static
+void
+alloc_near(void)
+{
+	critical_t critical;
+	char *str[40];
+	char *old;
+	char *near;
+	int n = NUMSTATICELS(str);
+
+	cclass_set_hugepage(true);
+	for (int i = 0; i < n; i++) {
+		NEWSTRING(str[i], 3000);
+	}
+
+	/* a free block on the hint's page is found behind others */
+	for (int i = 30; i < 33; i++) {
+		FREEOBJ(str[i]);
+	}
+	old = str[10];
+	FREEOBJ(str[10]);
+	for (int i = 33; i < 36; i++) {
+		FREEOBJ(str[i]);
+	}
+	near = MALLOC_NEAR(3000, str[11]);
+	XASSERT(near == old) {
+		/* empty */
+	}
+
+	/* else the block is carved next to the hint */
+	NEWOBJ_NEAR(critical, str[n - 1]);
+	VERIFY(critical) {
+		XASSERT((size_t) ((char *) critical - str[n - 1]) < 8192) {
+			/* empty */
+		}
+	}
+	FREEOBJ(critical);
+	XASSERT(NEWOBJ_NEAR(critical, 0)) {
+		FREEOBJ(critical);
+	}
+
+	FREEOBJ(near);
+	for (int i = 0; i < n; i++) {
+		FREEOBJ(str[i]);
+	}
+	cclass_set_hugepage(false);
+}
+
+/**
+ * @brief Return idle arena memory to the kernel
+ */
+static
+void
+alloc_trim(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	cclass_arena_info before, info;
+	cclass_trim_info stats;
+	char *str[10];
+	char *keep;
+	int n = NUMSTATICELS(str);
+	int zero = 1;
+
+	cclass_set_hugepage(true);
+	NEWSTRING(keep, 10);
+	for (int i = 0; i < n; i++) {
+		NEWSTRING(str[i], 40000);
+		memset(str[i], 'x', 39999);
+	}
+	for (int i = 0; i < n; i++) {
+		FREEOBJ(str[i]);
+	}
+
+	/* nothing is idle long enough yet */
+	XASSERT(!cclass_trim(60000)) {
+		/* empty */
+	}
+
+	/* pages inside free blocks are released, and come back zeroed */
+	XASSERT(cclass_trim(0) > 0) {
+		/* empty */
+	}
+	cclass_trim_stats(&stats);
+	XASSERT(stats.released > 0 && stats.passes >= 2) {
+		/* empty */
+	}
+	NEWSTRING(str[0], 40000);
+	for (int i = 0; i < 40000; i++) {
+		zero &= !str[0][i];
+	}
+	XASSERT(zero) {
+		/* empty */
+	}
+	FREEOBJ(str[0]);
+
+	/* regions without objects are unmapped */
+	FREEOBJ(keep);
+	cclass_arena_stats(&before);
+	cclass_trim(0);
+	cclass_arena_stats(&info);
+	XASSERT(info.mapped < before.mapped) {
+		/* empty */
+	}
+	cclass_set_hugepage(false);
+
+	/* in the background, under the application's heap lock */
+	XASSERT(!cclass_trim_start(0, &lock) &&
+		cclass_trim_start(20, &lock) &&
+		!cclass_trim_start(20, &lock)) {
+		usleep(100000);
+		cclass_trim_stop();
+	}
+	cclass_trim_stats(&stats);
+	XASSERT(stats.passes > 3) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Setup function for test suite
+ */
+static
+void
+setup(void)
+{
+	if (!verbose) {
+		redirect_dev_null(stderr);
+		redirect_dev_null(stdout);
+	}
+}
+
+/** all oversized requests were refused */
+static bool too_big_refused;
+
+/**
+ * @brief Refuse sizes that would wrap the block size
+ */
+static
+void
+alloc_too_big(void)
+{
+	char *str;
+	void *mem[2];
+
+	NEWSTRING(str, 10);
+	too_big_refused = (!cclass_malloc(SIZE_MAX - 2, 0, SRCFILE, __LINE__) &&
+			   !cclass_malloc(SIZE_MAX - 15, 0, SRCFILE, __LINE__) &&
+			   !cclass_malloc(SIZE_MAX - 55, 0, SRCFILE, __LINE__) &&
+			   !cclass_malloc_batch(2, SIZE_MAX - 20, 0, mem,
+						SRCFILE, __LINE__) &&
+			   !cclass_realloc(str, SIZE_MAX, SRCFILE, __LINE__) &&
+			   cclass_usable_size(str) >= 10);
+	FREEOBJ(str);
+}
+
+/**
+ * @brief Walk a heap holding a block without allocation site
+ */
+static
+void
+alloc_nosite(void)
+{
+	void *mem = cclass_malloc(10, 0, 0, 0);
+
+	XASSERT(mem) {
+		cclass_walk_heap();
+		cclass_free(mem);
+	}
+}
+
+/**
+ * @brief Test alloc_free()
+ */
+START_TEST(test_alloc_free)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_free));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_nofree()
+ */
+START_TEST(test_alloc_nofree)
+{
+	fail_unless(EXIT_FAILURE == cclass_assert_test(alloc_nofree));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_many()
+ */
+START_TEST(test_alloc_many)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_many));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_batch()
+ */
+START_TEST(test_alloc_batch)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_batch));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_backend()
+ */
+START_TEST(test_alloc_backend)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_backend));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_backend_fail()
+ */
+START_TEST(test_alloc_backend_fail)
+{
+	fail_unless(EXIT_FAILURE == cclass_assert_test(alloc_backend_fail));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_hugepage()
+ */
+START_TEST(test_alloc_hugepage)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_hugepage));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_foreach()
+ */
+START_TEST(test_alloc_foreach)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_foreach));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_budget()
+ */
+START_TEST(test_alloc_budget)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_budget));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_budget_realloc()
+ */
+START_TEST(test_alloc_budget_realloc)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_budget_realloc));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_reserve()
+ */
+START_TEST(test_alloc_reserve)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_reserve));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_metrics()
+ */
+START_TEST(test_alloc_metrics)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_metrics));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_trace()
+ */
+START_TEST(test_alloc_trace)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_trace));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_latency()
+ */
+START_TEST(test_alloc_latency)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_latency));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_intern()
+ */
+START_TEST(test_alloc_intern)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_intern));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_overhead()
+ */
+START_TEST(test_alloc_overhead)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_overhead));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_child()
+ */
+START_TEST(test_alloc_child)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_child));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_persist()
+ */
+START_TEST(test_alloc_persist)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_persist));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_shared()
+ */
+START_TEST(test_alloc_shared)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_shared));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_handle()
+ */
+START_TEST(test_alloc_handle)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_handle));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_refs()
+ */
+START_TEST(test_alloc_refs)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_refs));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_backtrace()
+ */
+START_TEST(test_alloc_backtrace)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_backtrace));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_profile()
+ */
+START_TEST(test_alloc_profile)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_profile));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_near()
+ */
+START_TEST(test_alloc_near)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_near));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_trim()
+ */
+START_TEST(test_alloc_trim)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_trim));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_too_big()
+ */
+START_TEST(test_alloc_too_big)
+{
+	/* each refusal is reported as out of memory */
+	fail_unless(EXIT_FAILURE == cclass_assert_test(alloc_too_big));
+	fail_unless(too_big_refused);
+}
+END_TEST
+
+/**
+ * @brief Test alloc_nosite()
+ */
+START_TEST(test_alloc_nosite)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_nosite));
 }
 END_TEST
 
@@ -132,6 +1515,31 @@ cclass_suite(void)
 	suite_add_tcase(s, tc_core);
 	tcase_add_test(tc_core, test_alloc_free);
 	tcase_add_test(tc_core, test_alloc_nofree);
+	tcase_add_test(tc_core, test_alloc_many);
+	tcase_add_test(tc_core, test_alloc_batch);
+	tcase_add_test(tc_core, test_alloc_backend);
+	tcase_add_test(tc_core, test_alloc_backend_fail);
+	tcase_add_test(tc_core, test_alloc_hugepage);
+	tcase_add_test(tc_core, test_alloc_foreach);
+	tcase_add_test(tc_core, test_alloc_budget);
+	tcase_add_test(tc_core, test_alloc_budget_realloc);
+	tcase_add_test(tc_core, test_alloc_reserve);
+	tcase_add_test(tc_core, test_alloc_metrics);
+	tcase_add_test(tc_core, test_alloc_trace);
+	tcase_add_test(tc_core, test_alloc_latency);
+	tcase_add_test(tc_core, test_alloc_intern);
+	tcase_add_test(tc_core, test_alloc_overhead);
+	tcase_add_test(tc_core, test_alloc_child);
+	tcase_add_test(tc_core, test_alloc_persist);
+	tcase_add_test(tc_core, test_alloc_shared);
+	tcase_add_test(tc_core, test_alloc_handle);
+	tcase_add_test(tc_core, test_alloc_refs);
+	tcase_add_test(tc_core, test_alloc_backtrace);
+	tcase_add_test(tc_core, test_alloc_profile);
+	tcase_add_test(tc_core, test_alloc_near);
+	tcase_add_test(tc_core, test_alloc_trim);
+	tcase_add_test(tc_core, test_alloc_nosite);
+	tcase_add_test(tc_core, test_alloc_too_big);
 	tcase_add_checked_fixture(tc_core, setup, NULL);
 
 	return s;
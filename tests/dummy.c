@@ -23,14 +23,32 @@
 
 USE_XASSERT
 
+/**
+ * @brief Initialise a new dummy object
+ *
+ * @param obj  object to initialise
+ */
+static
+void
+dummy_init(void *obj);
+
 /**
  * @brief dummy object
  */
-CLASS(dummy, dummy_t) {
-	char *data; /**< character array */
+CLASS_WITH(dummy, dummy_t, .init = dummy_init) {
+	char *data; /**< character array, owned by the object */
 	int size; /**< size of array */
 };
 
+void
+dummy_init(void *obj)
+{
+	dummy_t dummy = obj;
+
+	dummy->data = 0;
+	dummy->size = 0;
+}
+
 dummy_t
 dummy_create(int size)
 {
@@ -43,23 +61,74 @@ dummy_create(int size)
 
 	if (dummy) {
 		dummy->size = size;
-		NEWSTRING(dummy->data, size);
+		NEWSTRING_CHILD(dummy->data, size, dummy);
 	}
 
 	return dummy;
 }
 
+int
+dummy_create_batch(dummy_t *dummy,
+		   int n,
+		   int size)
+{
+	if (n < 0 || size < 0) {
+		return 0;
+	}
+
+	if (!NEWOBJ_BATCH(dummy, n)) {
+		return 0;
+	}
+
+	for (int i = 0; i < n; i++) {
+		dummy[i]->size = size;
+		NEWSTRING_CHILD(dummy[i]->data, size, dummy[i]);
+	}
+
+	return n;
+}
+
 dummy_t
 dummy_destroy(dummy_t dummy)
 {
 	VERIFYZ(dummy) {
-		cclass_free(dummy->data);
 		FREEOBJ(dummy);
 	}
 
 	return 0;
 }
 
+void
+dummy_destroy_batch(dummy_t *dummy,
+		    int n)
+{
+	FREEOBJ_BATCH(dummy, n);
+}
+
+/**
+ * @brief Destroy one dummy object, counting it
+ *
+ * @param obj  object to destroy
+ * @param arg  counter to increment
+ */
+static
+void
+dummy_destroy_one(void *obj,
+		  void *arg)
+{
+	dummy_t dummy = obj;
+	FREEOBJ(dummy);
+	++*(int *) arg;
+}
+
+int
+dummy_destroy_all(void)
+{
+	int destroyed = 0;
+	FOREACHOBJ(dummy, dummy_destroy_one, &destroyed);
+	return destroyed;
+}
+
 int
 dummy_set(dummy_t dummy,
 	  int value)
@@ -41,6 +41,20 @@ NEWHANDLE(dummy_t);
 dummy_t
 dummy_create(int size);
 
+/**
+ * @brief Create several dummy objects at once
+ *
+ * @param dummy  where to place the new object handles
+ * @param n  number of objects to create
+ * @param size  number of bytes to allocate per object
+ *
+ * @return number of objects created
+ */
+int
+dummy_create_batch(dummy_t *dummy,
+		   int n,
+		   int size);
+
 /**
  * @brief Destroy dummy object
  *
@@ -51,6 +65,24 @@ dummy_create(int size);
 dummy_t
 dummy_destroy(dummy_t dummy);
 
+/**
+ * @brief Destroy several dummy objects at once
+ *
+ * @param dummy  handles of objects to be destroyed, set to 0
+ * @param n  number of objects
+ */
+void
+dummy_destroy_batch(dummy_t *dummy,
+		    int n);
+
+/**
+ * @brief Destroy all live dummy objects
+ *
+ * @return number of objects destroyed
+ */
+int
+dummy_destroy_all(void);
+
 /**
  * @brief Access allocated memory
  *
@@ -0,0 +1,187 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Test the C++ typed objects
+ */
+#include <check.h>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "cclass/classdef.h"
+#include "cclass/handle.hpp"
+
+USE_XASSERT
+
+/** Object counting its live instances */
+struct session {
+	static int live; /**< number of constructed sessions */
+	int fd; /**< payload */
+
+	/**
+	 * @brief Construct session
+	 *
+	 * @param fd  payload, negative to throw
+	 */
+	explicit session(int fd) : fd(fd)
+	{
+		if (fd < 0) {
+			throw std::invalid_argument("fd");
+		}
+		live++;
+	}
+
+	/** Destruct session */
+	~session()
+	{
+		live--;
+	}
+};
+
+int session::live = 0;
+
+namespace cclass {
+/** Class descriptor settings of session */
+template <>
+struct traits<session> {
+	/** @return class name tag */
+	static const char *name()
+	{
+		return "session";
+	}
+
+	static const unsigned flags = CCLASS_HUGEPAGE; /**< flags */
+};
+} /* namespace cclass */
+
+/** Object with default class descriptor settings */
+struct plain_t {
+	long value; /**< payload */
+};
+
+/** Class descriptor of plain_t, as named for the C macros */
+static classdesc &plain_classdesc = *cclass::descriptor<plain_t>();
+
+/**
+ * @brief Construct, verify and destroy typed objects
+ */
+static
+void
+alloc_make(void)
+{
+	session *s = cclass::make<session>(42);
+	plain_t *p = cclass::make<plain_t>();
+
+	XASSERT(cclass::verify(s) && s->fd == 42 && session::live == 1 &&
+		cclass::verify(p) && p->value == 0 &&
+		!cclass::verify(reinterpret_cast<session *>(p)) &&
+		!std::strcmp(cclass::descriptor<session>()->name, "session") &&
+		cclass::descriptor<session>()->count == 1) {
+		/* empty */
+	}
+
+	/* macros and templates agree on the header layout */
+	plain_t *plain = p;
+	XASSERT(_VERIFY(plain)) {
+		/* empty */
+	}
+
+	cclass::destroy(s);
+	cclass::destroy(p);
+	XASSERT(!s && !p && session::live == 0) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Free memory when a constructor throws
+ */
+static
+void
+alloc_throw(void)
+{
+	bool thrown = false;
+
+	try {
+		cclass::make<session>(-1);
+	} catch (const std::invalid_argument &) {
+		thrown = true;
+	}
+	XASSERT(thrown && session::live == 0) {
+		/* empty */
+	}
+}
+
+/**
+ * @brief Test alloc_make()
+ */
+START_TEST(test_alloc_make)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_make));
+}
+END_TEST
+
+/**
+ * @brief Test alloc_throw()
+ */
+START_TEST(test_alloc_throw)
+{
+	fail_unless(EXIT_SUCCESS == cclass_assert_test(alloc_throw));
+}
+END_TEST
+
+/**
+ * @brief Create test suite
+ *
+ * @return test suite
+ */
+static
+Suite *
+handle_suite(void)
+{
+	Suite *s = suite_create("handle");
+
+	TCase *tc_core = tcase_create("Core");
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, test_alloc_make);
+	tcase_add_test(tc_core, test_alloc_throw);
+
+	return s;
+}
+
+/**
+ * @brief handle test program
+ *
+ * @return:
+ * - EXIT_SUCCESS if all tests succeeded
+ * - EXIT_FAILURE if any test fails
+ */
+int
+main(void)
+{
+	XASSERT_INTERACTIVE = false;
+
+	int nf;
+	Suite *s = handle_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	nf = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
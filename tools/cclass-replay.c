@@ -0,0 +1,502 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Replay an allocation trace against the heap
+ *
+ * Run the allocations, reallocations and frees recorded by
+ * cclass_trace_start() again, in time order and on one thread, and
+ * report throughput, peak resident memory and fragmentation.  Options
+ * select the heap configuration, so that configurations can be
+ * compared on the same trace.
+ *
+ * Fragmentation is the part of the peak resident memory gained during
+ * the replay that does not hold the peak live payload.  Resident memory
+ * is sampled at every new live peak as well as periodically.
+ */
+#include <argp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "cclass/assert.h"
+#include "cclass/malloc.h"
+#include "cclass/trace.h"
+
+/**
+ * @def PROGRAM_NAME
+ * @brief program name
+ */
+#define PROGRAM_NAME "cclass-replay"
+/**
+ * @def PROGRAM_DOC
+ * @brief program documentation
+ */
+#define PROGRAM_DOC  PROGRAM_NAME " -- replay an allocation trace"
+
+/**
+ * @def PTR_HASH(id)
+ * @brief Hash of a block id
+ */
+#define PTR_HASH(id) (((id) >> 4) * 0x9e3779b97f4a7c15ull)
+
+/** program version */
+const char *argp_program_version =
+PROGRAM_NAME " (" PACKAGE_NAME ") " PACKAGE_VERSION;
+
+/** bug report address */
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+/** command line settings */
+typedef struct settings_tag {
+	const char *path; /**< trace file */
+	bool hugepage; /**< serve all objects from the huge page arena */
+	bool flags; /**< honour recorded class flags */
+	size_t reserve; /**< emergency reserve bytes */
+	unsigned sample; /**< events between resident memory samples */
+} settings;
+
+/** argp options */
+static const struct argp_option options[] = {
+	{ "hugepage", 'H', 0, 0, "Serve all objects from the huge page arena",
+	  0 },
+	{ "no-flags", 'F', 0, 0, "Ignore recorded class flags", 0 },
+	{ "reserve", 'r', "BYTES", 0, "Set up an emergency reserve", 0 },
+	{ "sample", 's', "N", 0,
+	  "Events between resident memory samples (default 1024)", 0 },
+	{ 0, 0, 0, 0, 0, 0 }
+};
+
+/** a recorded site */
+typedef struct site_tag {
+	char *file; /**< file name, or 0 */
+	int line; /**< line number */
+} site;
+
+/** a recorded class */
+typedef struct class_tag {
+	uint64_t id; /**< class id in the trace */
+	classdesc desc; /**< class descriptor of the replay */
+} class;
+
+/** replay state */
+static struct replay_tag {
+	cclass_trace_event *event; /**< heap events in time order */
+	size_t events; /**< number of heap events */
+	site *site; /**< sites by id */
+	size_t sites; /**< number of entries in site */
+	class *class; /**< classes in order of naming */
+	size_t classes; /**< number of classes */
+	uint64_t *block; /**< open addressed block ids */
+	void **mem; /**< heap object of block id */
+	size_t *bytes; /**< payload size of block id */
+	size_t size; /**< power of two block table size */
+} replay;
+
+/**
+ * @brief Parse a single option
+ */
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+	settings *s = state->input;
+
+	switch (key) {
+	case 'H':
+		s->hugepage = true;
+		break;
+	case 'F':
+		s->flags = false;
+		break;
+	case 'r':
+		s->reserve = strtoul(arg, 0, 0);
+		break;
+	case 's':
+		s->sample = strtoul(arg, 0, 10);
+		break;
+	case ARGP_KEY_ARG:
+		if (state->arg_num > 0) {
+			argp_usage(state);
+		}
+		s->path = arg;
+		break;
+	case ARGP_KEY_END:
+		if (state->arg_num < 1) {
+			argp_usage(state);
+		}
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+/** our argp parser */
+static struct argp argp = {
+	.options = options,
+	.parser = parse_opt,
+	.args_doc = "TRACE",
+	.doc = PROGRAM_DOC,
+};
+
+/**
+ * @brief Order events by time, then by position in the trace
+ */
+static int
+event_compare(const void *a, const void *b)
+{
+	const cclass_trace_event *x = a;
+	const cclass_trace_event *y = b;
+
+	if (x->time != y->time) {
+		return (x->time > y->time) - (x->time < y->time);
+	}
+	return (x->reserved > y->reserved) - (x->reserved < y->reserved);
+}
+
+/**
+ * @brief Read a trace file
+ *
+ * Collect the site and class names, and the heap events sorted by
+ * time.
+ *
+ * @param s  settings
+ *
+ * @return true if the trace was read
+ */
+static bool
+trace_read(const settings *s)
+{
+	cclass_trace_header header;
+	cclass_trace_event *all = 0;
+	size_t n = 0;
+	FILE *f = fopen(s->path, "rb");
+	long bytes;
+
+	if (!f) {
+		perror(s->path);
+		return false;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    header.magic != CCLASS_TRACE_MAGIC ||
+	    header.version != CCLASS_TRACE_VERSION ||
+	    header.event_size != sizeof(cclass_trace_event)) {
+		fprintf(stderr, "%s: not a trace file\n", s->path);
+		fclose(f);
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	bytes = ftell(f) - (long) sizeof(header);
+	fseek(f, sizeof(header), SEEK_SET);
+	all = malloc(bytes + sizeof(cclass_trace_event));
+	if (all) {
+		n = fread(all, sizeof(cclass_trace_event),
+			  bytes / sizeof(cclass_trace_event), f);
+	}
+	fclose(f);
+	if (!all) {
+		return false;
+	}
+
+	/* Take names out, keep heap events in place */
+	replay.event = all;
+	for (size_t i = 0; i < n; i++) {
+		cclass_trace_event *e = &all[i];
+		size_t skip = 0;
+		char *name = 0;
+
+		if (e->op == CCLASS_TRACE_SITE || e->op == CCLASS_TRACE_CLASS) {
+			skip = (e->block + sizeof(cclass_trace_event)) /
+			       sizeof(cclass_trace_event);
+			if (i + skip >= n) {
+				break;
+			}
+			name = strndup((const char *) (e + 1), e->block);
+		}
+		if (e->op == CCLASS_TRACE_SITE) {
+			if (e->site >= replay.sites) {
+				size_t sites = 2 * e->site + 16;
+				replay.site = realloc(replay.site,
+						      sites * sizeof(site));
+				memset(&replay.site[replay.sites], 0,
+				       (sites - replay.sites) * sizeof(site));
+				replay.sites = sites;
+			}
+			replay.site[e->site].file = name;
+			replay.site[e->site].line = (int) e->size;
+		} else if (e->op == CCLASS_TRACE_CLASS) {
+			class *c;
+			replay.class = realloc(replay.class,
+					       (replay.classes + 1) *
+					       sizeof(class));
+			c = &replay.class[replay.classes++];
+			memset(c, 0, sizeof(*c));
+			c->id = e->class;
+			c->desc.name = name;
+			c->desc.flags = (s->flags ? (unsigned) e->size : 0);
+		} else {
+			/* Number events so equal times keep trace order */
+			replay.event[replay.events] = *e;
+			replay.event[replay.events].reserved = replay.events;
+			replay.events++;
+		}
+		i += skip;
+	}
+	qsort(replay.event, replay.events, sizeof(cclass_trace_event),
+	      event_compare);
+
+	/* Size block table for all blocks live at once */
+	replay.size = 1024;
+	while (replay.size < 2 * replay.events) {
+		replay.size *= 2;
+	}
+	replay.block = calloc(replay.size, sizeof(uint64_t));
+	replay.mem = calloc(replay.size, sizeof(void *));
+	replay.bytes = calloc(replay.size, sizeof(size_t));
+
+	return replay.block && replay.mem && replay.bytes;
+}
+
+/**
+ * @brief Find the slot of a block id
+ *
+ * @param id  block id
+ *
+ * @return slot of id, or the empty slot where it belongs
+ */
+static size_t
+block_slot(uint64_t id)
+{
+	size_t h = PTR_HASH(id) & (replay.size - 1);
+
+	while (replay.block[h] && replay.block[h] != id) {
+		h = (h + 1) & (replay.size - 1);
+	}
+
+	return h;
+}
+
+/**
+ * @brief Forget a block id
+ *
+ * @param h  slot of block id
+ */
+static void
+block_remove(size_t h)
+{
+	size_t mask = replay.size - 1;
+
+	/* Shift later entries of the probe run back into the hole */
+	for (size_t next = (h + 1) & mask; replay.block[next];
+	     next = (next + 1) & mask) {
+		size_t home = PTR_HASH(replay.block[next]) & mask;
+		if (((next - home) & mask) >= ((next - h) & mask)) {
+			replay.block[h] = replay.block[next];
+			replay.mem[h] = replay.mem[next];
+			replay.bytes[h] = replay.bytes[next];
+			h = next;
+		}
+	}
+	replay.block[h] = 0;
+	replay.mem[h] = 0;
+}
+
+/**
+ * @brief Look up the replay class descriptor of a class id
+ */
+static classdesc *
+class_lookup(uint64_t id)
+{
+	for (size_t i = 0; id && i < replay.classes; i++) {
+		if (replay.class[i].id == id) {
+			return &replay.class[i].desc;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Resident memory of the process in bytes
+ */
+static size_t
+resident(void)
+{
+	unsigned long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		unsigned long size;
+		if (fscanf(f, "%lu %lu", &size, &pages) != 2) {
+			pages = 0;
+		}
+		fclose(f);
+	}
+
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Seconds between two times
+ */
+static double
+elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+	       (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Program entry point
+ */
+int
+main(int argc, char *argv[])
+{
+	settings s = { .flags = true, .sample = 1024 };
+	struct timespec start, stop;
+	struct rusage usage;
+	cclass_arena_info arena;
+	size_t base, peak = 0, live = 0, max_live = 0;
+	size_t skipped = 0;
+	double seconds = 0;
+
+	argp_parse(&argp, argc, argv, 0, 0, &s);
+	XASSERT_INTERACTIVE = false;
+	if (!trace_read(&s)) {
+		return EXIT_FAILURE;
+	}
+	if (!s.sample) {
+		s.sample = 1024;
+	}
+
+	cclass_set_hugepage(s.hugepage);
+	if (s.reserve) {
+		cclass_set_reserve(s.reserve);
+	}
+
+	/* Fault the block table in before measuring */
+	memset(replay.block, 0, replay.size * sizeof(uint64_t));
+	memset(replay.mem, 0, replay.size * sizeof(void *));
+	memset(replay.bytes, 0, replay.size * sizeof(size_t));
+	base = resident();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < replay.events; i++) {
+		cclass_trace_event *e = &replay.event[i];
+		const site *where = (e->site < replay.sites ?
+				     &replay.site[e->site] : 0);
+		const char *file = (where ? where->file : 0);
+		int line = (where ? where->line : 0);
+		size_t h;
+		void *mem;
+
+		switch (e->op) {
+		case CCLASS_TRACE_MALLOC:
+			mem = cclass_malloc(e->size, class_lookup(e->class),
+					    file, line);
+			h = block_slot(e->block);
+			if (mem && !replay.block[h]) {
+				replay.block[h] = e->block;
+				replay.mem[h] = mem;
+				replay.bytes[h] = e->size;
+				live += e->size;
+			} else {
+				cclass_free(mem);
+				skipped++;
+			}
+			break;
+		case CCLASS_TRACE_REALLOC:
+			h = block_slot(e->old);
+			if (!replay.block[h]) {
+				skipped++;
+				break;
+			}
+			mem = cclass_realloc(replay.mem[h], e->size, file,
+					     line);
+			if (mem) {
+				live -= replay.bytes[h];
+				block_remove(h);
+				h = block_slot(e->block);
+				replay.block[h] = e->block;
+				replay.mem[h] = mem;
+				replay.bytes[h] = e->size;
+				live += e->size;
+			} else {
+				skipped++;
+			}
+			break;
+		case CCLASS_TRACE_FREE:
+			h = block_slot(e->block);
+			if (!replay.block[h]) {
+				skipped++;
+				break;
+			}
+			live -= replay.bytes[h];
+			cclass_free(replay.mem[h]);
+			block_remove(h);
+			break;
+		default:
+			skipped++;
+			break;
+		}
+		/* Sample resident memory off the clock */
+		if (live > max_live || !((i + 1) % s.sample) ||
+		    i + 1 == replay.events) {
+			size_t rss;
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+			seconds += elapsed(&start, &stop);
+			rss = resident();
+			rss = (rss > base ? rss - base : 0);
+			if (rss > peak) {
+				peak = rss;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		}
+		if (live > max_live) {
+			max_live = live;
+		}
+	}
+	getrusage(RUSAGE_SELF, &usage);
+	cclass_arena_stats(&arena);
+
+	printf("events         %zu (%zu skipped)\n", replay.events, skipped);
+	printf("elapsed        %.6f s\n", seconds);
+	if (seconds > 0 && replay.events) {
+		printf("throughput     %.0f ops/s (%.1f ns/op)\n",
+		       replay.events / seconds, seconds * 1e9 / replay.events);
+	}
+	printf("peak live      %zu bytes\n", max_live);
+	printf("peak resident  %zu bytes gained, %ld kB max RSS\n", peak,
+	       usage.ru_maxrss);
+	if (peak) {
+		printf("fragmentation  %.1f%%\n",
+		       100.0 * (peak > max_live ? peak - max_live : 0) / peak);
+	}
+	if (arena.regions) {
+		printf("arena          %zu of %zu bytes used, "
+		       "%zu backed by huge pages\n",
+		       arena.used, arena.mapped, arena.backed);
+	}
+
+	return EXIT_SUCCESS;
+}
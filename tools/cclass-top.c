@@ -0,0 +1,256 @@
+/* $Id$
+ * Copyright (C) 2005 Deneys S. Maartens <dsm@tlabs.ac.za>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+/**
+ * @file
+ * @brief Show live heap metrics of a running process
+ *
+ * Attach read-only to the metrics segment published by
+ * cclass_metrics_publish() and print the heap totals, allocation and
+ * free rates, and the classes and sites with the most live bytes.
+ */
+#include <argp.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "cclass/metrics.h"
+
+/**
+ * @def PROGRAM_NAME
+ * @brief program name
+ */
+#define PROGRAM_NAME "cclass-top"
+/**
+ * @def PROGRAM_DOC
+ * @brief program documentation
+ */
+#define PROGRAM_DOC  PROGRAM_NAME " -- show live heap metrics of a process"
+
+/** program version */
+const char *argp_program_version =
+PROGRAM_NAME " (" PACKAGE_NAME ") " PACKAGE_VERSION;
+
+/** bug report address */
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+/** command line settings */
+typedef struct settings_tag {
+	pid_t pid; /**< process to watch */
+	unsigned delay; /**< seconds between updates */
+	unsigned count; /**< number of updates, 0 for no limit */
+	unsigned lines; /**< rows per table */
+} settings;
+
+/** argp options */
+static const struct argp_option options[] = {
+	{ "delay", 'd', "SECS", 0, "Seconds between updates (default 1)", 0 },
+	{ "count", 'n', "N", 0, "Exit after N updates", 0 },
+	{ "lines", 'l', "N", 0, "Rows per table (default 10)", 0 },
+	{ 0, 0, 0, 0, 0, 0 }
+};
+
+/**
+ * @brief Parse a single option
+ */
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+	settings *s = state->input;
+
+	switch (key) {
+	case 'd':
+		s->delay = strtoul(arg, 0, 10);
+		break;
+	case 'n':
+		s->count = strtoul(arg, 0, 10);
+		break;
+	case 'l':
+		s->lines = strtoul(arg, 0, 10);
+		break;
+	case ARGP_KEY_ARG:
+		if (state->arg_num > 0) {
+			argp_usage(state);
+		}
+		s->pid = strtol(arg, 0, 10);
+		break;
+	case ARGP_KEY_END:
+		if (state->arg_num < 1) {
+			argp_usage(state);
+		}
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+/** our argp parser */
+static struct argp argp = {
+	.options = options,
+	.parser = parse_opt,
+	.args_doc = "PID",
+	.doc = PROGRAM_DOC,
+};
+
+/** a table row being sorted */
+typedef struct row_tag {
+	char name[CCLASS_METRICS_NAME + 16]; /**< row label */
+	cclass_counters now; /**< current counters */
+	cclass_counters then; /**< counters at the previous update */
+} row;
+
+/**
+ * @brief Order rows by descending live bytes
+ */
+static int
+row_compare(const void *a, const void *b)
+{
+	int64_t x = ((const row *) a)->now.bytes;
+	int64_t y = ((const row *) b)->now.bytes;
+
+	return (x < y) - (x > y);
+}
+
+/**
+ * @brief Print one row
+ */
+static void
+row_print(const char *name, const cclass_counters *now,
+	  const cclass_counters *then, unsigned delay)
+{
+	printf("%-32.32s %10lld %12lld %10llu %10llu\n", name,
+	       (long long) now->blocks, (long long) now->bytes,
+	       (unsigned long long) (now->allocs - then->allocs) / delay,
+	       (unsigned long long) (now->frees - then->frees) / delay);
+}
+
+/**
+ * @brief Print the column headings of a table
+ *
+ * The first update has no previous counters to take rates from, so it
+ * shows the totals since the process started.
+ */
+static void
+heading_print(const char *title, unsigned update)
+{
+	printf("\n%-32s %10s %12s %10s %10s\n", title, "objects", "bytes",
+	       update ? "allocs/s" : "allocs", update ? "frees/s" : "frees");
+}
+
+/**
+ * @brief Print a table of the busiest rows
+ */
+static void
+table_print(const char *title, row *rows, unsigned n, const settings *s,
+	    unsigned update)
+{
+	qsort(rows, n, sizeof(row), row_compare);
+	heading_print(title, update);
+	for (unsigned i = 0; i < n && i < s->lines; i++) {
+		if (rows[i].now.allocs) {
+			row_print(rows[i].name, &rows[i].now, &rows[i].then,
+				  update ? s->delay : 1);
+		}
+	}
+}
+
+/**
+ * @brief Program entry point
+ */
+int
+main(int argc, char *argv[])
+{
+	settings s = { .delay = 1, .lines = 10 };
+	static cclass_counters classes[CCLASS_METRICS_CLASSES];
+	static cclass_counters sites[CCLASS_METRICS_SITES];
+	static row rows[CCLASS_METRICS_SITES];
+	const cclass_metrics *m;
+	cclass_counters total = { 0, 0, 0, 0 };
+	char name[32];
+	int fd;
+
+	argp_parse(&argp, argc, argv, 0, 0, &s);
+	if (!s.delay) {
+		s.delay = 1;
+	}
+
+	snprintf(name, sizeof(name), CCLASS_METRICS_PATH, (int) s.pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: no metrics published by %d\n",
+			PROGRAM_NAME, (int) s.pid);
+		return EXIT_FAILURE;
+	}
+	m = mmap(0, sizeof(cclass_metrics), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED ||
+	    __atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) !=
+	    CCLASS_METRICS_MAGIC || m->version != CCLASS_METRICS_VERSION) {
+		fprintf(stderr, "%s: unrecognised metrics segment %s\n",
+			PROGRAM_NAME, name);
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned update = 0; !s.count || update < s.count; update++) {
+		unsigned nclasses = m->classes;
+		unsigned nsites = m->sites;
+
+		if (nclasses > CCLASS_METRICS_CLASSES) {
+			nclasses = CCLASS_METRICS_CLASSES;
+		}
+		if (nsites > CCLASS_METRICS_SITES - 1) {
+			nsites = CCLASS_METRICS_SITES - 1;
+		}
+		if (update) {
+			sleep(s.delay);
+		}
+
+		printf("\npid %d\n", (int) m->pid);
+		heading_print("", update);
+		row_print("total", &m->total, &total, update ? s.delay : 1);
+		total = m->total;
+
+		for (unsigned i = 0; i < nclasses; i++) {
+			snprintf(rows[i].name, sizeof(rows[i].name), "%.*s",
+				 CCLASS_METRICS_NAME, m->class[i].name);
+			rows[i].now = m->class[i].counters;
+			rows[i].then = classes[i];
+			classes[i] = rows[i].now;
+		}
+		table_print("class", rows, nclasses, &s, update);
+
+		for (unsigned i = 0; i <= nsites; i++) {
+			unsigned slot = i < nsites ? i : CCLASS_METRICS_SITES - 1;
+			snprintf(rows[i].name, sizeof(rows[i].name),
+				 "%.*s:%lld", CCLASS_METRICS_NAME,
+				 m->site[slot].file,
+				 (long long) m->site[slot].line);
+			rows[i].now = m->site[slot].counters;
+			rows[i].then = sites[slot];
+			sites[slot] = rows[i].now;
+		}
+		table_print("site", rows, nsites + 1, &s, update);
+		fflush(stdout);
+	}
+
+	return EXIT_SUCCESS;
+}